@@ -0,0 +1,324 @@
+//
+// This project is licensed under the terms of the MIT license.
+//
+
+/******************************* libcesu8 small-string benchmark ***********************************
+
+Measures the latency of the libcesu8 entry points on short strings (20-200 bytes), where the cost
+of a call is dominated by its setup rather than by the kernels' throughput. Every entry point is
+run on strings of several lengths and code point distributions; the time of each call is sampled
+and reported as percentiles, in nanoseconds per call and CPU cycles per byte.
+
+Build and run it with 'make bench'. Options:
+
+    cesu8-bench [-n <samples>] [-l <len>,...]
+
+On x86-64 the time stamp counter is read (calibrated against CLOCK_MONOTONIC), elsewhere
+clock_gettime() is used and cycles/byte are not reported. Pin the benchmark to a CPU and keep the
+frequency fixed (e.g. taskset -c 2, performance governor) for reproducible results.
+**************************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "cesu8.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#define SAMPLES     100000      // default number of samples per measurement
+#define BATCH       8           // calls timed together, to keep the timer's overhead small
+#define MAXLEN      4096        // longest input string
+#define NSTRINGS    64          // different strings per input (to not to measure a single branch pattern)
+
+int samples = SAMPLES;
+int lens[16] = {20, 64, 200};
+int nlens = 3;
+
+double cyclesPerNs = 0;        // TSC frequency (GHz); 0: no TSC
+
+////////////////////////////////////////////
+// Timer:
+
+static inline uint64_t ticks()
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+uint64_t nsNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void calibrate()
+{
+#ifdef HAVE_TSC
+    uint64_t n0 = nsNow(), t0 = ticks();
+    while (nsNow() - n0 < 100000000u)       // 100 ms
+        ;
+    uint64_t n1 = nsNow(), t1 = ticks();
+    cyclesPerNs = (double)(t1 - t0) / (n1 - n0);
+#endif
+}
+
+double ticksToNs(double t)
+{
+    return cyclesPerNs ? t / cyclesPerNs : t;
+}
+
+////////////////////////////////////////////
+// Inputs: UTF-8 strings of the given code point distribution, and their CESU-8 versions
+
+enum { ASCII, BMP, ONEPAIR, PAIRS, NDISTS };
+const char *distNames[NDISTS] = {"ascii", "mixed BMP", "one pair", "many pairs"};
+
+unsigned char utf[NSTRINGS][MAXLEN];
+size_t utflen[NSTRINGS];
+unsigned char cesu[NSTRINGS][MAXLEN * 2];
+size_t cesulen[NSTRINGS];
+
+int putUtf8(unsigned char *p, unsigned cp)
+{
+    if (cp < 0x80) {
+        p[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        p[0] = 0xc0 | (cp >> 6);
+        p[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    } else if (cp < 0x10000) {
+        p[0] = 0xe0 | (cp >> 12);
+        p[1] = 0x80 | ((cp >> 6) & 0x3f);
+        p[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    p[0] = 0xf0 | (cp >> 18);
+    p[1] = 0x80 | ((cp >> 12) & 0x3f);
+    p[2] = 0x80 | ((cp >> 6) & 0x3f);
+    p[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+unsigned randomCp(int dist)
+{
+    switch (dist) {
+    case ASCII:
+    case ONEPAIR:
+        return 0x20 + rand() % 0x5f;
+    case BMP:
+        switch (rand() % 4) {
+        case 0:  return 0x20 + rand() % 0x5f;
+        case 1:  return 0xa0 + rand() % 0x700;
+        default: return 0x3000 + rand() % 0xa000;       // CJK etc. (no surrogates)
+        }
+    default:
+        return 0x10000 + rand() % 0x100000;
+    }
+}
+
+// Fill the strings with len bytes (UTF-8) of the distribution; the CESU-8 versions are longer
+void makeInputs(int dist, int len)
+{
+    for (int s = 0; s < NSTRINGS; s++) {
+        unsigned char *p = utf[s];
+        int n = 0;
+        int pairpos = (dist == ONEPAIR) ? rand() % (len - 3) : -1;
+        while (n < len) {
+            unsigned cp = (n >= pairpos && pairpos >= 0) ? 0x10000 + (unsigned)rand() % 0x100000 : randomCp(dist);
+            if (n >= pairpos)
+                pairpos = -1;
+            unsigned char c[4];
+            int l = putUtf8(c, cp);
+            if (n + l > len)
+                cp = 'x', l = putUtf8(c, cp);     // fill the end with ASCII
+            memcpy(p + n, c, l);
+            n += l;
+        }
+        utflen[s] = n;
+
+        size_t inlen = n, outlen = sizeof(cesu[s]);
+        cesu8_convert(CESU8_U2C | CESU8_LAST, utf[s], &inlen, cesu[s], &outlen);
+        cesulen[s] = outlen;
+    }
+}
+
+////////////////////////////////////////////
+// Entry points:
+
+unsigned char out[MAXLEN * 2];
+volatile size_t sink;           // keeps the calls from being optimized out
+
+void callConvertC2u(int s)
+{
+    size_t inlen = cesulen[s], outlen = sizeof(out);
+    cesu8_convert(CESU8_C2U | CESU8_LAST, cesu[s], &inlen, out, &outlen);
+    sink = outlen;
+}
+
+void callConvertU2c(int s)
+{
+    size_t inlen = utflen[s], outlen = sizeof(out);
+    cesu8_convert(CESU8_U2C | CESU8_LAST, utf[s], &inlen, out, &outlen);
+    sink = outlen;
+}
+
+void callCowC2u(int s)
+{
+    size_t outlen;
+    const unsigned char *r = cesu8_convert_cow(CESU8_C2U, cesu[s], cesulen[s], &outlen);
+    if (r != cesu[s])
+        free((void *)r);
+    sink = outlen;
+}
+
+void callCowU2c(int s)
+{
+    size_t outlen;
+    const unsigned char *r = cesu8_convert_cow(CESU8_U2C, utf[s], utflen[s], &outlen);
+    if (r != utf[s])
+        free((void *)r);
+    sink = outlen;
+}
+
+struct entry {
+    const char *name;
+    void (*call)(int s);
+    bool cesuinput;
+} entries[] = {
+    {"cesu8_convert c2u", callConvertC2u, true},
+    {"cesu8_convert u2c", callConvertU2c, false},
+    {"cesu8_convert_cow c2u", callCowC2u, true},
+    {"cesu8_convert_cow u2c", callCowU2c, false},
+};
+
+////////////////////////////////////////////
+// Measurement:
+
+int cmpDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(const double *sorted, int n, double p)
+{
+    int i = (int)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+double timerOverhead()                  // median ticks of an empty timed batch
+{
+    double *t = malloc(sizeof(double) * samples);
+    for (int i = 0; i < samples; i++) {
+        uint64_t t0 = ticks();
+        __asm__ volatile("" ::: "memory");
+        t[i] = (double)(ticks() - t0);
+    }
+    qsort(t, samples, sizeof(double), cmpDouble);
+    double o = t[samples / 2];
+    free(t);
+    return o;
+}
+
+void measure(struct entry *e, int dist, double overhead)
+{
+    double *t = malloc(sizeof(double) * samples);
+    if (!t) {
+        fprintf(stderr, "cesu8-bench: Error: out of memory\n");
+        exit(1);
+    }
+    double bytes = 0;
+    for (int s = 0; s < NSTRINGS; s++)
+        bytes += e->cesuinput ? cesulen[s] : utflen[s];
+    bytes /= NSTRINGS;
+
+    for (int i = 0; i < samples / 10; i++)  // warm up
+        e->call(i % NSTRINGS);
+    for (int i = 0; i < samples; i++) {
+        int s = (i * BATCH) % NSTRINGS;
+        uint64_t t0 = ticks();
+        for (int b = 0; b < BATCH; b++)
+            e->call(s + b);
+        double d = (double)(ticks() - t0) - overhead;
+        t[i] = (d > 0 ? d : 0) / BATCH;
+    }
+    qsort(t, samples, sizeof(double), cmpDouble);
+
+    static const double ps[] = {50, 90, 99, 99.9};
+    printf("%-22s %-11s %5.0f ", e->name, distNames[dist], bytes);
+    for (int i = 0; i < 4; i++)
+        printf(" %8.1f", ticksToNs(percentile(t, samples, ps[i])));
+    if (cyclesPerNs)
+        printf("  %7.2f %7.2f", percentile(t, samples, 50) / bytes, percentile(t, samples, 99) / bytes);
+    printf("\n");
+    free(t);
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            nlens = 0;
+            for (char *p = argv[++i]; *p && nlens < 16; p++) {
+                lens[nlens++] = (int)strtol(p, &p, 10);
+                if (*p != ',')
+                    break;
+            }
+        } else {
+            fprintf(stderr, "Usage: cesu8-bench [-n <samples>] [-l <len>,...]\n"
+                            "  Measures the latency of libcesu8 calls on short strings (percentiles of\n"
+                            "  ns/call and cycles/byte), for each length (default: 20,64,200 bytes)\n");
+            return 1;
+        }
+    }
+    if (samples < 100)
+        samples = 100;
+    for (int l = 0; l < nlens; l++) {
+        if (lens[l] < 8 || lens[l] > MAXLEN) {
+            fprintf(stderr, "cesu8-bench: Error: length must be 8..%d\n", MAXLEN);
+            return 1;
+        }
+    }
+
+    srand(1);
+    calibrate();
+    double overhead = timerOverhead();
+    if (cyclesPerNs)
+        printf("TSC: %.2f GHz, timer overhead: %.0f cycles, %d samples of %d calls\n", cyclesPerNs, overhead, samples, BATCH);
+    else
+        printf("timer overhead: %.0f ns, %d samples of %d calls\n", overhead, samples, BATCH);
+
+    printf("\n%-22s %-11s %5s  %8s %8s %8s %8s", "entry point", "input", "bytes", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns");
+    if (cyclesPerNs)
+        printf("  %7s %7s", "p50 c/B", "p99 c/B");
+    printf("\n");
+
+    for (int l = 0; l < nlens; l++) {
+        for (int d = 0; d < NDISTS; d++) {
+            makeInputs(d, lens[l]);
+            for (size_t e = 0; e < sizeof(entries) / sizeof(entries[0]); e++)
+                measure(&entries[e], d, overhead);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+// vim: tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
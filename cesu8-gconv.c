@@ -0,0 +1,171 @@
+//
+// This project is licensed under the terms of the MIT license.
+//
+
+/******************************* glibc gconv module for CESU-8 *************************************
+
+Registers the CESU-8 charset with glibc's iconv: iconv(1), iconv(3) and everything built on them
+can convert CESU-8 in-process. The module converts directly between CESU-8 and UTF-8 with
+cesu8_convert(); glibc chains its builtin UTF-8 step for any other charset.
+
+Build CESU-8.so ('make CESU-8.so') and point GCONV_PATH to the directory containing it and the
+gconv-modules file:
+
+    GCONV_PATH=/path/to/cesu8 iconv -f CESU-8 -t UTF-16 file
+
+Unpaired surrogates and invalid 4-byte codes are reported as illegal input (EILSEQ), unless
+//IGNORE is requested: then they are skipped.
+**************************************************************************************************/
+
+#include <gconv.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "cesu8.h"
+
+// The direction of the step, pointed to by step->__data:
+static const int c2u = CESU8_C2U;
+static const int u2c = CESU8_U2C;
+
+int gconv_init(struct __gconv_step *step)
+{
+    if (strcmp(step->__from_name, "CESU-8//") == 0 && strcmp(step->__to_name, "ISO-10646/UTF8/") == 0) {
+        step->__data = (void *)&c2u;
+        step->__min_needed_from = 1;
+        step->__max_needed_from = 6;
+        step->__min_needed_to = 1;
+        step->__max_needed_to = 4;
+    } else if (strcmp(step->__from_name, "ISO-10646/UTF8/") == 0 && strcmp(step->__to_name, "CESU-8//") == 0) {
+        step->__data = (void *)&u2c;
+        step->__min_needed_from = 1;
+        step->__max_needed_from = 4;
+        step->__min_needed_to = 1;
+        step->__max_needed_to = 6;
+    } else
+        return __GCONV_NOCONV;
+
+    step->__stateful = 0;
+    return __GCONV_OK;
+}
+
+void gconv_end(struct __gconv_step *step)
+{
+    (void)step;     // nothing allocated
+}
+
+// Convert as much of inptr..inend to outbuf..outend as possible. Illegal sequences are skipped
+// (and counted in *lirreversible) if errors are ignored, otherwise conversion stops at them.
+static int convertStep(int flags, bool ignore, const unsigned char **inptrp, const unsigned char *inend,
+                       unsigned char **outbufp, unsigned char *outend, size_t *lirreversible)
+{
+    for (;;) {
+        size_t inlen = inend - *inptrp;
+        size_t outlen = outend - *outbufp;
+        int status = cesu8_convert(flags, *inptrp, &inlen, *outbufp, &outlen);
+        *inptrp += inlen;
+        *outbufp += outlen;
+        switch (status) {
+        case CESU8_OK:
+            return __GCONV_EMPTY_INPUT;
+        case CESU8_FULL:
+            return __GCONV_FULL_OUTPUT;
+        case CESU8_INCOMPLETE:
+            return __GCONV_INCOMPLETE_INPUT;
+        default:
+            if (!ignore)
+                return __GCONV_ILLEGAL_INPUT;
+            // skip the unpaired surrogate or the invalid 4-byte code:
+            *inptrp += (flags & CESU8_U2C) ? 4 : 3;
+            ++*lirreversible;
+        }
+    }
+}
+
+int gconv(struct __gconv_step *step, struct __gconv_step_data *data,
+          const unsigned char **inptrp, const unsigned char *inend,
+          unsigned char **outbufstart, size_t *irreversible, int do_flush,
+          int consume_incomplete)
+{
+    struct __gconv_step *next_step = step + 1;
+    struct __gconv_step_data *next_data = data + 1;
+    // Our output is UTF-8 or CESU-8: the next step, if any, is glibc's builtin UTF-8 decoder,
+    // whose function pointer is not mangled (only the ones of loaded modules are).
+    __gconv_fct fct = (data->__flags & __GCONV_IS_LAST) ? NULL : next_step->__fct;
+    int status;
+
+    if (!(data->__flags & __GCONV_IS_LAST) && next_step->__shlib_handle != NULL)
+        return __GCONV_INTERNAL_ERROR;
+
+    if (do_flush) {
+        // Stateless conversion: nothing is buffered here, just pass the flush on
+        status = __GCONV_OK;
+        if (fct)
+            status = fct(next_step, next_data, NULL, NULL, NULL, irreversible, do_flush, consume_incomplete);
+        return status;
+    }
+
+    int flags = *(const int *)step->__data | CESU8_STRICT;
+    bool ignore = (data->__flags & __GCONV_IGNORE_ERRORS) != 0;
+
+    unsigned char *outbuf = outbufstart ? *outbufstart : data->__outbuf;
+    unsigned char *outend = data->__outbufend;
+
+    for (;;) {
+        const unsigned char *instart = *inptrp;
+        unsigned char *outstart = outbuf;
+        size_t lirreversible = 0;
+
+        status = convertStep(flags, ignore, inptrp, inend, &outbuf, outend, &lirreversible);
+
+        // Called as part of an error handling: nothing else to do here
+        if (outbufstart) {
+            *outbufstart = outbuf;
+            return status;
+        }
+
+        ++data->__invocation_counter;
+
+        if (data->__flags & __GCONV_IS_LAST) {
+            // the caller gets the output directly
+            data->__outbuf = outbuf;
+            if (irreversible)
+                *irreversible += lirreversible;
+            break;
+        }
+
+        // Pass the produced output to the next step:
+        if (outbuf > outstart) {
+            const unsigned char *outerr = data->__outbuf;
+            int result = fct(next_step, next_data, &outerr, outbuf, NULL, irreversible, 0, consume_incomplete);
+
+            if (result != __GCONV_EMPTY_INPUT) {
+                if (outerr != outbuf) {
+                    // The next step didn't take all of it: redo the conversion up to that point,
+                    // so that *inptrp points after the input actually consumed.
+                    *inptrp = instart;
+                    outbuf = outstart;
+                    lirreversible = 0;
+                    convertStep(flags, ignore, inptrp, inend, &outbuf, (unsigned char *)outerr, &lirreversible);
+                    if (outbuf == outstart)
+                        --data->__invocation_counter;
+                }
+                status = result;
+            } else if (status == __GCONV_FULL_OUTPUT) {
+                // All the output is consumed, another run is possible
+                status = __GCONV_OK;
+            }
+        }
+        if (irreversible)
+            *irreversible += lirreversible;
+
+        if (status != __GCONV_OK)
+            break;
+
+        // Reset the output buffer pointer for the next round
+        outbuf = data->__outbuf;
+    }
+
+    return status;
+}
+
+// vim: tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
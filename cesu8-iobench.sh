@@ -0,0 +1,170 @@
+#!/bin/sh
+#
+# This project is licensed under the terms of the MIT license.
+#
+# cesu8 I/O benchmark: runs cesu8 end-to-end over a generated CESU-8 file in different I/O
+# situations, with each I/O backend of cesu8 and several buffer sizes, and prints a table of
+# the throughput (MB/s of input, best of the runs). A second table shows the effect of the
+# block size (--block-size) of the conversion on large (-b 1M) buffers.
+#
+# Situations:
+#   hot     input and output files in the page cache (input read before the run)
+#   cold    input file evicted from the page cache before each run (posix_fadvise DONTNEED,
+#           via 'dd iflag=nocache'), output written to a file
+#   pipe    input from a pipe, output to a pipe
+#   tmpfs   input and output files on tmpfs (/dev/shm)
+# Backends:
+#   plain   read/convert/write in one thread (fread/fwrite)
+#   pool    read-ahead and write-behind threads (--max-memory)
+#   threads conversion threads (-j 0); it reads 1M chunks, -b has no effect on it
+#
+# Usage: cesu8-iobench.sh [-s <MB>] [-r <runs>] [-d <dir>] [-b "<sizes>"] [-k "<sizes>"]
+#   -s   size of the test file in MB (default: 256)
+#   -r   number of runs of each measurement (default: 3)
+#   -d   directory for the test files (default: $TMPDIR or /tmp)
+#   -b   buffer sizes (-b option of cesu8; default: "4k 64k 1M")
+#   -k   block sizes (--block-size option of cesu8; default: "4k 16k 64k 256k")
+# Set CESU8 to the cesu8 binary to test (default: ./cesu8).
+
+CESU8=${CESU8:-./cesu8}
+SIZE=256
+RUNS=3
+DIR=${TMPDIR:-/tmp}
+BSIZES="4k 64k 1M"
+KSIZES="4k 16k 64k 256k"
+SHM=/dev/shm
+
+while getopts s:r:d:b:k: opt; do
+    case $opt in
+    s) SIZE=$OPTARG ;;
+    r) RUNS=$OPTARG ;;
+    d) DIR=$OPTARG ;;
+    b) BSIZES=$OPTARG ;;
+    k) KSIZES=$OPTARG ;;
+    *) sed -n '21,27p' "$0" >&2; exit 1 ;;
+    esac
+done
+
+if [ ! -x "$CESU8" ]; then
+    echo "cesu8-iobench: Error: $CESU8 not found (run 'make cesu8' or set CESU8)" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d "$DIR/cesu8-iobench.XXXXXX") || exit 1
+SHMWORK=
+if [ -d "$SHM" ] && [ -w "$SHM" ]; then
+    SHMWORK=$(mktemp -d "$SHM/cesu8-iobench.XXXXXX")
+fi
+trap 'rm -rf "$WORK" $SHMWORK' EXIT INT TERM
+
+# Generate the input: mostly ASCII lines with some BMP characters and a surrogate pair
+# (U+1F600, in CESU-8) every 100 bytes or so; doubled up to the requested size
+printf 'The quick brown fox jumps over the lazy dog. \303\251\303\250 \342\202\254 \355\240\275\355\270\200 line\n' > "$WORK/in.cesu"
+while [ $(wc -c < "$WORK/in.cesu") -lt $((SIZE * 1024 * 1024)) ]; do
+    cat "$WORK/in.cesu" "$WORK/in.cesu" > "$WORK/tmp" && mv "$WORK/tmp" "$WORK/in.cesu"
+done
+BYTES=$(wc -c < "$WORK/in.cesu")
+[ -n "$SHMWORK" ] && cp "$WORK/in.cesu" "$SHMWORK/in.cesu"
+
+now() {
+    date +%s%N
+}
+
+WIDTH=9     # of the table columns
+
+failed() {
+    printf " %${WIDTH}s" failed
+}
+
+# run <situation> <options>: print the best throughput in MB/s
+run() {
+    best=0
+    i=0
+    while [ $i -lt $RUNS ]; do
+        case $1 in
+        hot)
+            cat "$WORK/in.cesu" > /dev/null
+            t0=$(now)
+            $CESU8 $2 -o "$WORK/out" "$WORK/in.cesu" || { failed; return; }
+            t1=$(now) ;;
+        cold)
+            rm -f "$WORK/out"
+            dd if="$WORK/in.cesu" iflag=nocache count=0 status=none
+            t0=$(now)
+            $CESU8 $2 -o "$WORK/out" "$WORK/in.cesu" || { failed; return; }
+            t1=$(now) ;;
+        pipe)
+            t0=$(now)
+            # (the status of a pipeline is the last command's: cesu8's own is passed in a file)
+            { cat "$WORK/in.cesu" | $CESU8 $2 -; echo $? > "$WORK/status"; } | cat > /dev/null
+            [ "$(cat "$WORK/status")" = 0 ] || { failed; return; }
+            t1=$(now) ;;
+        tmpfs)
+            t0=$(now)
+            $CESU8 $2 -o "$SHMWORK/out" "$SHMWORK/in.cesu" || { failed; return; }
+            t1=$(now) ;;
+        esac
+        ns=$((t1 - t0))
+        [ $ns -gt 0 ] || ns=1
+        mbs=$((BYTES * 1000 / ns))      # bytes/ns * 1000 = MB/s
+        [ $mbs -gt $best ] && best=$mbs
+        i=$((i + 1))
+    done
+    printf " %${WIDTH}s" "$best"
+}
+
+echo "cesu8 I/O benchmark: $((BYTES / 1024 / 1024)) MB CESU-8 input in $DIR, best of $RUNS runs (MB/s)"
+echo
+printf '%-8s %-8s' situation backend
+for b in $BSIZES; do
+    printf " %${WIDTH}s" "-b $b"
+done
+echo
+
+for situation in hot cold pipe tmpfs; do
+    if [ $situation = tmpfs ] && [ -z "$SHMWORK" ]; then
+        echo "tmpfs    (no writable $SHM, skipped)"
+        continue
+    fi
+    for backend in plain pool threads; do
+        case $backend in
+        plain)   opts= ;;
+        pool)    opts="--max-memory 64M" ;;
+        threads) opts="-j 0" ;;
+        esac
+        printf '%-8s %-8s' $situation $backend
+        for b in $BSIZES; do
+            run $situation "$opts -b $b"
+        done
+        echo
+    done
+done
+
+# The block size matters for the plain and pool backends only (-j converts by libcesu8)
+echo
+WIDTH=17
+printf '%-8s %-8s' situation backend
+for k in $KSIZES; do
+    printf " %${WIDTH}s" "--block-size $k"
+done
+echo
+
+for situation in hot cold pipe tmpfs; do
+    if [ $situation = tmpfs ] && [ -z "$SHMWORK" ]; then
+        echo "tmpfs    (no writable $SHM, skipped)"
+        continue
+    fi
+    for backend in plain pool; do
+        case $backend in
+        plain)   opts= ;;
+        pool)    opts="--max-memory 64M" ;;
+        esac
+        printf '%-8s %-8s' $situation $backend
+        for k in $KSIZES; do
+            run $situation "$opts -b 1M --block-size $k"
+        done
+        echo
+    done
+done
+
+# vim: tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# This project is licensed under the terms of the MIT license.
+#
+# cesu8 -j check: the threaded conversion cuts the input into 1M chunks, and it has to give the
+# same output and the same warnings as the conversion in one thread. The inputs are ASCII with a
+# run of (valid or invalid) sequences across the 1M chunk boundary, shifted by 0..7 bytes, and a
+# random binary file of a few chunks; each one is converted with and without -j, -i and -f.
+#
+# Usage: cesu8-jcheck.sh [-d <dir>]
+#   -d   directory for the test files (default: $TMPDIR or /tmp)
+# Set CESU8 to the cesu8 binary to test (default: ./cesu8).
+
+CESU8=${CESU8:-./cesu8}
+DIR=${TMPDIR:-/tmp}
+CHUNK=1048576
+
+while getopts d: opt; do
+    case $opt in
+    d) DIR=$OPTARG ;;
+    *) sed -n '10,12p' "$0" >&2; exit 1 ;;
+    esac
+done
+
+if [ ! -x "$CESU8" ]; then
+    echo "cesu8-jcheck: Error: $CESU8 not found (run 'make cesu8' or set CESU8)" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d "$DIR/cesu8-jcheck.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+head -c $CHUNK /dev/zero | tr '\0' a > "$WORK/ascii"
+failed=0
+checked=0
+
+# check <file>: compare the output and the warnings of -j with the ones of one thread
+check() {
+    for opts in "" "-f" "-i" "-i -f"; do
+        $CESU8 $opts -o "$WORK/out1" "$1" 2> "$WORK/err1"
+        $CESU8 $opts -j 2 -o "$WORK/out2" "$1" 2> "$WORK/err2"
+        if ! cmp -s "$WORK/out1" "$WORK/out2" || ! cmp -s "$WORK/err1" "$WORK/err2"; then
+            printf 'cesu8-jcheck: -j differs: %s, options: %s\n' "$2" "${opts:-none}"
+            failed=$((failed + 1))
+        fi
+        checked=$((checked + 1))
+    done
+}
+
+# surrogate pair, unpaired low and high surrogates, 4-byte UTF-8, truncated 4-byte UTF-8,
+# stray continuation bytes, 3-byte UTF-8:
+for seq in '\355\240\275\355\270\200' '\355\270\200' '\355\240\275' '\360\237\230\200' '\360\237' '\200' '\342\202\254'; do
+    printf "$seq$seq$seq$seq$seq$seq$seq$seq$seq$seq" > "$WORK/run"
+    len=$(wc -c < "$WORK/run")
+    shift=0
+    while [ $shift -lt 8 ]; do
+        head -c $((CHUNK - len / 2 - shift)) "$WORK/ascii" > "$WORK/in"
+        cat "$WORK/run" "$WORK/run" >> "$WORK/in"
+        head -c 100 "$WORK/ascii" >> "$WORK/in"
+        check "$WORK/in" "sequence $seq at $((CHUNK - len / 2 - shift))"
+        shift=$((shift + 1))
+    done
+done
+
+head -c $((3 * CHUNK + 123)) /dev/urandom > "$WORK/in"
+check "$WORK/in" "random input"
+
+if [ $failed -gt 0 ]; then
+    echo "cesu8-jcheck: $failed of $checked checks failed"
+    exit 1
+fi
+echo "cesu8-jcheck: $checked checks passed"
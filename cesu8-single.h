@@ -0,0 +1,541 @@
+//
+// This project is licensed under the terms of the MIT license.
+//
+
+/******************************* cesu8-single.h: single-header conversion **************************
+
+The conversion kernels of libcesu8 (the find, check and convert steps of cesu8.c and the buffer
+loops) with cesu8_convert(), cesu8_convert_cow() and cesu8_find(), in one header, stb-style: the
+compiler can inline them into the caller's loops, which matters for short strings. The internal
+names are prefixed by cesu8__ (CESU8__ for the macros, which are undefined at the end), so they
+don't clash with the caller's names.
+
+Define CESU8_IMPLEMENTATION before including it in the file(s) using the functions:
+
+    #define CESU8_IMPLEMENTATION
+    #include "cesu8-single.h"
+
+The functions are static inline by default (every file gets its own copy). Define CESU8_DEF
+(e.g. as empty) to get extern definitions instead; libcesu8.c is built this way. The flags and
+status codes are defined here only, cesu8.h includes this header for them (with CESU8_DEF empty):
+don't include cesu8.h together with the static inline version. See cesu8.h for the description
+of the API.
+**************************************************************************************************/
+
+#ifndef CESU8_SINGLE_H
+#define CESU8_SINGLE_H
+
+#include <stddef.h>
+
+#ifndef CESU8_DEF
+#define CESU8_DEF static inline
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Conversion flags:
+#define CESU8_C2U           0x00    // Convert CESU-8 to UTF-8 (this is the default)
+#define CESU8_U2C           0x01    // Convert UTF-8 to CESU-8; i.e. inverse conversion (-i)
+#define CESU8_FIX           0x02    // Convert unpaired surrogates and invalid 4-byte codes to '?' (-f)
+#define CESU8_STRICT        0x04    // Stop at unpaired surrogates and invalid 4-byte codes (CESU8_INVALID)
+#define CESU8_LAST          0x08    // No more input follows: a partial sequence at the end is left unchanged
+#define CESU8_NORMALIZE     0x10    // Accept both encodings, write UTF-8 (or CESU-8 with CESU8_U2C); see cesu8.h
+#define CESU8_REPLACE       0x20    // Convert malformed sequences to U+FFFD (at CESU8_NORMALIZE)
+
+// Status codes returned by cesu8_convert():
+#define CESU8_OK            0       // all input converted
+#define CESU8_FULL          1       // output buffer is full
+#define CESU8_INCOMPLETE    2       // input ends within a sequence; call again with more input
+#define CESU8_INVALID       3       // unpaired surrogate (3 bytes) or invalid 4-byte code (4 bytes) at *inlen
+                                    // (or any malformed sequence at CESU8_NORMALIZE)
+
+CESU8_DEF int cesu8_convert(int flags, const unsigned char *in, size_t *inlen, unsigned char *out, size_t *outlen);
+CESU8_DEF const unsigned char *cesu8_convert_cow(int flags, const unsigned char *in, size_t len, size_t *outlen);
+CESU8_DEF size_t cesu8_find(int flags, const unsigned char *in, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CESU8_SINGLE_H
+
+#if defined(CESU8_IMPLEMENTATION) && !defined(CESU8_SINGLE_IMPLEMENTED)
+#define CESU8_SINGLE_IMPLEMENTED
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CESU8__U_BYTE            0xed   // 1110 1101
+#define CESU8__V_BYTE_FIXMASK    0xf0
+#define CESU8__V_BYTE_FIXVAL     0xa0   // 1010 vvvv
+#define CESU8__W_BYTE_FIXMASK    0xc0
+#define CESU8__W_BYTE_FIXVAL     0x80   // 10ww wwww
+#define CESU8__X_BYTE            0xed   // 1110 1101
+#define CESU8__Y_BYTE_FIXMASK    0xf0
+#define CESU8__Y_BYTE_FIXVAL     0xb0   // 1011 yyyy
+#define CESU8__Z_BYTE_FIXMASK    0xc0
+#define CESU8__Z_BYTE_FIXVAL     0x80   // 10zz zzzz
+
+#define CESU8__P_BYTE_FIXMASK    0xf8
+#define CESU8__P_BYTE_FIXVAL     0xf0   // 1111 0VVV
+#define CESU8__QRS_BYTE_FIXMASK  0xc0
+#define CESU8__QRS_BYTE_FIXVAL   0x80   // 10VV wwww, 10ww yyyy, 10zz zzzz
+
+////////////////////////////////////////////
+// Searching for a CESU-8 sequence:
+
+static inline size_t cesu8__find_U(const unsigned char *buff, size_t i, size_t blen) // find the first byte of the 6-byte CESU-8 sequence
+{
+    // memchr() is vectorized by the C library
+    const unsigned char *u = (const unsigned char *)memchr(buff + i, CESU8__U_BYTE, blen - i);
+    return u ? (size_t)(u - buff) : blen;   // return blen if not found
+}
+
+static inline bool cesu8__is_found_1st_three(const unsigned char *s)               // is it a high surrogate?
+{
+//  if (s[0] != CESU8__U_BYTE) return false;                                       // s[0] is definitely CESU8__U_BYTE (cesu8__find_U was called), check all others only
+    if ((s[1] & CESU8__V_BYTE_FIXMASK) != CESU8__V_BYTE_FIXVAL) return false;
+    if ((s[2] & CESU8__W_BYTE_FIXMASK) != CESU8__W_BYTE_FIXVAL) return false;
+    return true;
+}
+static inline bool cesu8__is_found_2nd_three(const unsigned char *s)               // is it a low surrogate?
+{
+    if (s[0] != CESU8__X_BYTE) return false;
+    if ((s[1] & CESU8__Y_BYTE_FIXMASK) != CESU8__Y_BYTE_FIXVAL) return false;
+    if ((s[2] & CESU8__Z_BYTE_FIXMASK) != CESU8__Z_BYTE_FIXVAL) return false;
+    return true;
+}
+
+static inline bool cesu8__is_found_six(const unsigned char *s)
+{
+    return cesu8__is_found_1st_three(s) && cesu8__is_found_2nd_three(s + 3);
+}
+
+static inline bool cesu8__is_partial_six(const unsigned char *s, size_t n)         // can the n (< 6) bytes at s be the start of a CESU-8 sequence?
+{
+    static const unsigned char mask[6] = { 0xff, CESU8__V_BYTE_FIXMASK, CESU8__W_BYTE_FIXMASK, 0xff, CESU8__Y_BYTE_FIXMASK, CESU8__Z_BYTE_FIXMASK };
+    static const unsigned char fixv[6] = { CESU8__U_BYTE, CESU8__V_BYTE_FIXVAL, CESU8__W_BYTE_FIXVAL, CESU8__X_BYTE, CESU8__Y_BYTE_FIXVAL, CESU8__Z_BYTE_FIXVAL };
+    for (size_t i = 0; i < n; i++) {
+        if ((s[i] & mask[i]) != fixv[i])
+            return false;
+    }
+    return true;
+}
+
+////////////////////////////////////////////
+// Convert CESU-8 to UTF-8:
+
+#define CESU8__COMB(a, b, bcount)  (((a) << (bcount)) | (b))    // combine bits
+
+static inline void cesu8__convert_six(const unsigned char *s, unsigned char *d)    // convert 6-byte CESU-8 at s to 4-byte UTF-8 at d
+{
+    int vvvv = s[1] & (0xff - CESU8__V_BYTE_FIXMASK);
+    int wwwwww = s[2] & (0xff - CESU8__W_BYTE_FIXMASK);
+    int yyyy = s[4] & (0xff - CESU8__Y_BYTE_FIXMASK);
+    unsigned char z = s[5];                                                 // no need to convert the last byte ... UTF-8 value is the same
+
+    int VVVVV = vvvv + 1;
+
+    d[0] = CESU8__P_BYTE_FIXVAL | (VVVVV >> 2);                             // p
+    d[1] = CESU8__QRS_BYTE_FIXVAL | ((VVVVV & 3) << 4) | (wwwwww >> 2);     // q
+    d[2] = CESU8__QRS_BYTE_FIXVAL | ((wwwwww & 3) << 4) | yyyy;             // r
+    d[3] = z;                                                               // s
+}
+
+////////////////////////////////////////////
+// Searching for a UTF-8 sequence:
+
+#define CESU8__HIGH_BITS         0x8080808080808080ull
+
+static inline size_t cesu8__find_P(const unsigned char *buff, size_t i, size_t blen) // find the first byte of the 4-byte UTF-8 sequence
+{
+    while (i < blen) {
+        if (i + 8 <= blen) {
+            // check 8 bytes at once: is there a byte with its 4 upper bits set (0xf0-0xff)?
+            uint64_t x;
+            memcpy(&x, buff + i, 8);
+            if (!(x & (x << 1) & (x << 2) & (x << 3) & CESU8__HIGH_BITS)) {
+                i += 8;
+                continue;
+            }
+        }
+        for (size_t e = (i + 8 < blen) ? i + 8 : blen; i < e; i++) {
+            if ((buff[i] & CESU8__P_BYTE_FIXMASK) == CESU8__P_BYTE_FIXVAL)
+                return i;
+        }
+    }
+    return blen;    // return blen if not found
+}
+
+static inline bool cesu8__is_found_four(const unsigned char *s)                    // is it indeed a 4-byte UTF-8 sequence?
+{
+    if ((s[1] & CESU8__QRS_BYTE_FIXMASK) != CESU8__QRS_BYTE_FIXVAL) return false;
+    if ((s[2] & CESU8__QRS_BYTE_FIXMASK) != CESU8__QRS_BYTE_FIXVAL) return false;
+    if ((s[3] & CESU8__QRS_BYTE_FIXMASK) != CESU8__QRS_BYTE_FIXVAL) return false;
+    return true;
+}
+
+static inline bool cesu8__is_partial_four(const unsigned char *s, size_t n)        // can the n (< 4) bytes at s be the start of a 4-byte UTF-8 sequence?
+{
+    for (size_t i = 1; i < n; i++) {
+        if ((s[i] & CESU8__QRS_BYTE_FIXMASK) != CESU8__QRS_BYTE_FIXVAL)
+            return false;
+    }
+    return true;
+}
+
+static inline bool cesu8__is_valid_four(const unsigned char *s)                    // does the 4-byte sequence encode U+10000..U+10FFFF?
+{
+    int VVVVV = CESU8__COMB(s[0] & (0xff - CESU8__P_BYTE_FIXMASK), (s[1] & (0xff - CESU8__QRS_BYTE_FIXMASK)) >> 4, 2);
+    // overlong UTF-8 (0) or too large Unicode (>0x10)
+    return VVVVV >= 1 && VVVVV <= 0x10;
+}
+
+////////////////////////////////////////////
+// Convert UTF-8 to CESU-8:
+
+static inline void cesu8__convert_four(const unsigned char *s, unsigned char *d)   // convert valid 4-byte UTF-8 at s to 6-byte CESU-8 at d
+{
+    int VVV = s[0] & (0xff - CESU8__P_BYTE_FIXMASK);
+    int VVwwww = s[1] & (0xff - CESU8__QRS_BYTE_FIXMASK);
+    int wwyyyy = s[2] & (0xff - CESU8__QRS_BYTE_FIXMASK);
+    unsigned char z = s[3];                                                 // no need to convert the last byte ... CESU-8 value is the same
+
+    int VVVVV = CESU8__COMB(VVV, VVwwww >> 4, 2);
+    int wwwwww = CESU8__COMB(VVwwww & 0x0f, wwyyyy >> 4, 2);
+    int yyyy = wwyyyy & 0x0f;
+
+    int vvvv = VVVVV - 1;
+
+    d[0] = CESU8__U_BYTE;                                                   // u
+    d[1] = CESU8__V_BYTE_FIXVAL | vvvv;                                     // v
+    d[2] = CESU8__W_BYTE_FIXVAL | wwwwww;                                   // w
+    d[3] = CESU8__X_BYTE;                                                   // x
+    d[4] = CESU8__Y_BYTE_FIXVAL | yyyy;                                     // y
+    d[5] = z;                                                               // z
+}
+
+////////////////////////////////////////////
+// Buffer conversion:
+
+// Input bytes in[rlen..blen) are converted to out[wlen..olen)
+struct cesu8__conv {
+    const unsigned char *in;
+    unsigned char *out;
+    size_t blen, rlen;
+    size_t olen, wlen;
+};
+
+static inline bool cesu8__step_to(struct cesu8__conv *c, size_t upos)              // copy the string between rlen and upos (write it to wlen)
+{
+    size_t addlen = upos - c->rlen;
+    bool fits = (addlen <= c->olen - c->wlen);
+    if (!fits) {
+        // copy as much as possible, but don't split a character:
+        addlen = c->olen - c->wlen;
+        for (int back = 0; back < 3 && addlen && (c->in[c->rlen + addlen] & CESU8__QRS_BYTE_FIXMASK) == CESU8__QRS_BYTE_FIXVAL; back++)
+            addlen--;
+    }
+    if (addlen) {
+        memmove(c->out + c->wlen, c->in + c->rlen, addlen);                 // (areas could overlap!)
+        c->rlen += addlen;
+        c->wlen += addlen;
+    }
+    return fits;
+}
+
+static inline bool cesu8__put_fix(struct cesu8__conv *c, size_t skip)              // replace skip bytes at rlen by '?'
+{
+    if (c->wlen == c->olen)
+        return false;
+    c->out[c->wlen++] = '?';
+    c->rlen += skip;
+    return true;
+}
+
+static inline int cesu8__convertCesuBuff(struct cesu8__conv *c, int flags)         // CESU-8 to UTF-8
+{
+    while (c->rlen < c->blen) {
+        size_t upos = cesu8__find_U(c->in, c->rlen, c->blen);
+        // upos is the position of the first byte of a potential 6-byte CESU-8 sequence (u), or == blen if not found
+        if (!cesu8__step_to(c, upos))
+            return CESU8_FULL;
+        if (c->rlen == c->blen)
+            break;
+        size_t left = c->blen - c->rlen;
+        const unsigned char *s = c->in + c->rlen;
+        if (left < 6 && !(flags & CESU8_LAST) && cesu8__is_partial_six(s, left))
+            return CESU8_INCOMPLETE;    // there are not enough bytes there, more input is needed
+        if (left >= 6 && cesu8__is_found_six(s)) {
+            if (c->olen - c->wlen < 4)
+                return CESU8_FULL;
+            cesu8__convert_six(s, c->out + c->wlen);
+            c->rlen += 6;
+            c->wlen += 4;
+        } else if (left >= 3 && (cesu8__is_found_1st_three(s) || cesu8__is_found_2nd_three(s))) {
+            // Oops, unpaired surrogate!
+            if (flags & CESU8_STRICT)
+                return CESU8_INVALID;
+            if (!((flags & CESU8_FIX) ? cesu8__put_fix(c, 3) : cesu8__step_to(c, c->rlen + 3)))
+                return CESU8_FULL;
+        } else {
+            // This is a normal non-surrogate code in the d000..d7ff range (or an invalid byte)
+            if (!cesu8__step_to(c, c->rlen + 1))
+                return CESU8_FULL;
+        }
+    }
+    return CESU8_OK;
+}
+
+static inline int cesu8__convertUtfBuff(struct cesu8__conv *c, int flags)          // UTF-8 to CESU-8
+{
+    while (c->rlen < c->blen) {
+        size_t ppos = cesu8__find_P(c->in, c->rlen, c->blen);
+        // ppos is the position of the first byte of a 4-byte UTF-8 sequence (p), or == blen if not found
+        if (!cesu8__step_to(c, ppos))
+            return CESU8_FULL;
+        if (c->rlen == c->blen)
+            break;
+        size_t left = c->blen - c->rlen;
+        const unsigned char *s = c->in + c->rlen;
+        if (left < 4 && !(flags & CESU8_LAST) && cesu8__is_partial_four(s, left))
+            return CESU8_INCOMPLETE;    // there are not enough bytes there, more input is needed
+        if (left >= 4 && cesu8__is_found_four(s)) {
+            if (cesu8__is_valid_four(s)) {
+                if (c->olen - c->wlen < 6)
+                    return CESU8_FULL;
+                cesu8__convert_four(s, c->out + c->wlen);
+                c->rlen += 4;
+                c->wlen += 6;
+            } else {
+                // overlong UTF-8 or too large Unicode
+                if (flags & CESU8_STRICT)
+                    return CESU8_INVALID;
+                // not to change: It's enough to copy the first byte now
+                if (!((flags & CESU8_FIX) ? cesu8__put_fix(c, 4) : cesu8__step_to(c, c->rlen + 1)))
+                    return CESU8_FULL;
+            }
+        } else {
+            // Invalid UTF-8 sequence: left unchanged
+            if (!cesu8__step_to(c, c->rlen + 1))
+                return CESU8_FULL;
+        }
+    }
+    return CESU8_OK;
+}
+
+////////////////////////////////////////////
+// Normalization (CESU8_NORMALIZE): UTF-8 and CESU-8 input, all the malformations handled in one pass
+
+enum { CESU8__SEQ_COPY, CESU8__SEQ_PAIR, CESU8__SEQ_FOUR, CESU8__SEQ_BAD, CESU8__SEQ_PARTIAL };
+
+// Classify the sequence at s (left bytes available); *n is set to its length
+static inline int cesu8__classify(const unsigned char *s, size_t left, bool last, size_t *n)
+{
+    unsigned char b = s[0];
+    size_t need;
+
+    *n = 1;
+    if (b < 0x80)
+        return CESU8__SEQ_COPY;
+    if (b < 0xc2 || b > 0xf7)
+        return CESU8__SEQ_BAD;      // stray continuation byte, overlong 2-byte lead, invalid byte
+    need = (b < 0xe0) ? 2 : (b < 0xf0) ? 3 : 4;
+    for (size_t i = 1; i < need; i++) {
+        if (i == left)
+            return last ? CESU8__SEQ_BAD : CESU8__SEQ_PARTIAL;
+        if ((s[i] & CESU8__QRS_BYTE_FIXMASK) != CESU8__QRS_BYTE_FIXVAL)
+            return CESU8__SEQ_BAD;  // truncated sequence: only the lead byte is malformed
+    }
+    *n = need;
+    if (need == 2)
+        return CESU8__SEQ_COPY;
+    if (need == 4)
+        return cesu8__is_valid_four(s) ? CESU8__SEQ_FOUR : CESU8__SEQ_BAD;
+    if (b == 0xe0 && s[1] < 0xa0)
+        return CESU8__SEQ_BAD;      // overlong 3-byte sequence
+    if (b != CESU8__U_BYTE || s[1] < 0xa0)
+        return CESU8__SEQ_COPY;
+    // a surrogate:
+    if ((s[1] & CESU8__V_BYTE_FIXMASK) != CESU8__V_BYTE_FIXVAL)
+        return CESU8__SEQ_BAD;      // unpaired low surrogate
+    if (left < 6 && !last && cesu8__is_partial_six(s, left))
+        return CESU8__SEQ_PARTIAL;
+    if (left >= 6 && cesu8__is_found_2nd_three(s + 3)) {
+        *n = 6;
+        return CESU8__SEQ_PAIR;
+    }
+    return CESU8__SEQ_BAD;          // unpaired high surrogate
+}
+
+static inline int cesu8__convertNormalize(struct cesu8__conv *c, int flags)    // UTF-8 or CESU-8 to either one
+{
+    bool last = flags & CESU8_LAST;
+    while (c->rlen < c->blen) {
+        size_t i = c->rlen, n = 0;
+        int cls = CESU8__SEQ_COPY;
+        // skip the valid characters (ASCII 8 bytes at once):
+        while (i < c->blen) {
+            if (i + 8 <= c->blen) {
+                uint64_t x;
+                memcpy(&x, c->in + i, 8);
+                if (!(x & CESU8__HIGH_BITS)) {
+                    i += 8;
+                    continue;
+                }
+            }
+            cls = cesu8__classify(c->in + i, c->blen - i, last, &n);
+            if (cls != CESU8__SEQ_COPY)
+                break;
+            i += n;
+        }
+        if (!cesu8__step_to(c, i))
+            return CESU8_FULL;
+        if (c->rlen == c->blen)
+            break;
+
+        const unsigned char *s = c->in + c->rlen;
+        size_t room = c->olen - c->wlen;
+        if (cls == CESU8__SEQ_PARTIAL)
+            return CESU8_INCOMPLETE;    // more input is needed
+        if (cls == CESU8__SEQ_PAIR && !(flags & CESU8_U2C)) {
+            if (room < 4)
+                return CESU8_FULL;
+            cesu8__convert_six(s, c->out + c->wlen);
+            c->wlen += 4;
+        } else if (cls == CESU8__SEQ_FOUR && (flags & CESU8_U2C)) {
+            if (room < 6)
+                return CESU8_FULL;
+            cesu8__convert_four(s, c->out + c->wlen);
+            c->wlen += 6;
+        } else if (cls != CESU8__SEQ_BAD || !(flags & (CESU8_FIX | CESU8_REPLACE | CESU8_STRICT))) {
+            // already in the target encoding, or a malformed sequence left unchanged
+            if (room < n)
+                return CESU8_FULL;
+            memcpy(c->out + c->wlen, s, n);
+            c->wlen += n;
+        } else if (flags & CESU8_STRICT) {
+            return CESU8_INVALID;
+        } else if (flags & CESU8_REPLACE) {
+            if (room < 3)
+                return CESU8_FULL;
+            memcpy(c->out + c->wlen, "\xef\xbf\xbd", 3);      // U+FFFD
+            c->wlen += 3;
+        } else {
+            if (room < 1)
+                return CESU8_FULL;
+            c->out[c->wlen++] = '?';
+        }
+        c->rlen += n;
+    }
+    return CESU8_OK;
+}
+
+CESU8_DEF int cesu8_convert(int flags, const unsigned char *in, size_t *inlen, unsigned char *out, size_t *outlen)
+{
+    struct cesu8__conv c = { in, out, *inlen, 0, *outlen, 0 };
+    int status = (flags & CESU8_NORMALIZE) ? cesu8__convertNormalize(&c, flags)
+                 : (flags & CESU8_U2C) ? cesu8__convertUtfBuff(&c, flags) : cesu8__convertCesuBuff(&c, flags);
+    *inlen = c.rlen;
+    *outlen = c.wlen;
+    return status;
+}
+
+////////////////////////////////////////////
+// Copy-on-write conversion:
+
+static inline size_t cesu8__find_change(int flags, const unsigned char *in, size_t len) // find the first sequence conversion would modify
+{
+    size_t i = 0;
+    if (flags & CESU8_NORMALIZE) {
+        // find the first sequence that isn't copied as it is
+        for (;;) {
+            size_t n;
+            while (i < len && cesu8__classify(in + i, len - i, true, &n) == CESU8__SEQ_COPY)
+                i += n;
+            if (i == len)
+                return len;
+            int cls = cesu8__classify(in + i, len - i, true, &n);
+            if (cls == CESU8__SEQ_PAIR ? !(flags & CESU8_U2C) : cls == CESU8__SEQ_FOUR ? (flags & CESU8_U2C) : (flags & (CESU8_FIX | CESU8_REPLACE)) != 0)
+                return i;
+            i += n;
+        }
+    } else if (flags & CESU8_U2C) {
+        while ((i = cesu8__find_P(in, i, len)) + 4 <= len) {
+            if (cesu8__is_found_four(in + i) && ((flags & CESU8_FIX) || cesu8__is_valid_four(in + i)))
+                return i;
+            i++;
+        }
+    } else {
+        while ((i = cesu8__find_U(in, i, len)) + 3 <= len) {
+            if (i + 6 <= len && cesu8__is_found_six(in + i))
+                return i;
+            if ((flags & CESU8_FIX) && (cesu8__is_found_1st_three(in + i) || cesu8__is_found_2nd_three(in + i)))
+                return i;
+            i++;
+        }
+    }
+    return len;     // return len if not found
+}
+
+CESU8_DEF size_t cesu8_find(int flags, const unsigned char *in, size_t len)
+{
+    return cesu8__find_change(flags, in, len);
+}
+
+CESU8_DEF const unsigned char *cesu8_convert_cow(int flags, const unsigned char *in, size_t len, size_t *outlen)
+{
+    size_t pos = cesu8__find_change(flags, in, len);
+    if (pos == len) {
+        // clean: nothing to convert
+        *outlen = len;
+        return in;
+    }
+
+    // 4-byte UTF-8 sequences are converted to 6-byte CESU-8 ones, a larger output buffer is needed:
+    size_t olen = (flags & CESU8_REPLACE) ? pos + (len - pos) * 3         // (a malformed byte to U+FFFD)
+                  : (flags & CESU8_U2C) ? pos + (len - pos) / 4 * 6 + 3 : len;
+    unsigned char *out = (unsigned char *)malloc(olen);
+    if (!out)
+        return NULL;
+    memcpy(out, in, pos);
+
+    size_t inlen = len - pos;
+    olen -= pos;
+    cesu8_convert((flags & ~CESU8_STRICT) | CESU8_LAST, in + pos, &inlen, out + pos, &olen);
+    *outlen = pos + olen;
+    return out;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#undef CESU8__U_BYTE
+#undef CESU8__V_BYTE_FIXMASK
+#undef CESU8__V_BYTE_FIXVAL
+#undef CESU8__W_BYTE_FIXMASK
+#undef CESU8__W_BYTE_FIXVAL
+#undef CESU8__X_BYTE
+#undef CESU8__Y_BYTE_FIXMASK
+#undef CESU8__Y_BYTE_FIXVAL
+#undef CESU8__Z_BYTE_FIXMASK
+#undef CESU8__Z_BYTE_FIXVAL
+#undef CESU8__P_BYTE_FIXMASK
+#undef CESU8__P_BYTE_FIXVAL
+#undef CESU8__QRS_BYTE_FIXMASK
+#undef CESU8__QRS_BYTE_FIXVAL
+#undef CESU8__COMB
+#undef CESU8__HIGH_BITS
+
+#endif // CESU8_IMPLEMENTATION
+
+// vim: tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
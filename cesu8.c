@@ -53,13 +53,39 @@ output:  1111 0VVV               10VV wwww               10ww yyyy   10zz zzzz
 #define QRS_BYTE_FIXMASK    0xc0
 #define QRS_BYTE_FIXVAL     0x80    // 10VV wwww, 10ww yyyy, 10zz zzzz
 
+#define _GNU_SOURCE         // sched_getaffinity(), pthread_setaffinity_np()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <locale.h>
-
-#define BSIZE 4096
+#include <sched.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cesu8.h"          // libcesu8: re-entrant conversion, used by the worker threads
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BMI2_KERNELS        // PEXT/PDEP versions of convert_six/convert_four, see detectBmi2()
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+#define BSIZE 4096                  // default buffer size (see -b)
+#define BLOCKSIZE (16 * 1024)       // default block size (see --block-size)
 
 // Global variables used by multiple functions:
 
@@ -70,12 +96,17 @@ bool silent = false;                // -s
 bool silentio = false;              // -S
 bool fixcode = false;               // -f
 bool inverse = false;               // -i    false: CESU-8 to UTF-8 conevrsion; true: UTF-8 to CESU-8 conversion.
+bool fingerprint = false;           // -H    hash the converted text instead of writing it
+bool framed = false;                // --coprocess   input and output are framed, see runCoprocess()
+bool latency = false;               // --latency   report the read-to-write latency, see latencyRead()
+bool usebmi2 = false;               // use PEXT/PDEP to convert the sequences (set by detectBmi2())
 
 FILE *fpi;                          // input FILE pointer
 FILE *fpo;                          // output FILE pointer
 
 // in place conversion is done in buff:
-unsigned char buff[BSIZE];
+unsigned char *buff;
+int bsize = BSIZE;                  // -b    size of buff
 int blen;                           // total bytes loaded to buff
 int rlen;                           // input bytes already processed in buff
 int wlen;                           // output bytes converted in buff
@@ -84,26 +115,235 @@ unsigned long long bufpos;          // position of first byte of buff in input f
 
 // inverse conversion requires a separate output buffer. 4 byte UTF-8 sequences
 // are converted to 6-byte CESU-8 ones, a larger output buffer is needed:
-unsigned char obuff[BSIZE + BSIZE / 2];
+unsigned char *obuff;               // (bsize + bsize / 2 bytes)
 // wlen pertains to this buffer in case of inverse conversion...
 
+// Large buffers are processed in blocks: scanning, converting and copying is done on one cache
+// resident block before moving on, so that each byte is loaded from memory only once.
+int blocksize = BLOCKSIZE;          // --block-size
+
+// coprocess mode: the request frame is read to buff, the response is collected in rbuff
+#define FRAME_MAXLEN        0xffffffffull   // the length field of a frame is 4 bytes
+unsigned long long framelen;        // bytes of the request frame not read yet
+unsigned char *rbuff;               // response buffer (grown as needed, kept for all frames)
+size_t rbsize;                      // allocated size of rbuff
+size_t rblen;                       // response bytes in rbuff
+
+////////////////////////////////////////////
+// Fingerprint of the converted text (-H): 64-bit xxHash (XXH64, seed 0) of the bytes writeBuff() gets
+
+#define PRIME64_1 0x9e3779b185ebca87ull
+#define PRIME64_2 0xc2b2ae3d27d4eb4full
+#define PRIME64_3 0x165667b19e3779f9ull
+#define PRIME64_4 0x85ebca77c2b2ae63ull
+#define PRIME64_5 0x27d4eb2f165667c5ull
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+uint64_t hacc[4];                   // accumulators of the 32-byte stripes
+unsigned char hmem[32];             // bytes of the last, incomplete stripe
+int hmemlen;
+unsigned long long hlen;            // total bytes hashed
+
+uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);               // (little endian hosts assumed)
+    return v;
+}
+
+uint64_t hashRound(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = ROTL64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+void hashReset()
+{
+    hacc[0] = PRIME64_1 + PRIME64_2;
+    hacc[1] = PRIME64_2;
+    hacc[2] = 0;
+    hacc[3] = -PRIME64_1;
+    hmemlen = 0;
+    hlen = 0;
+}
+
+void hashStripes(const unsigned char *p, size_t n)   // n is a multiple of 32
+{
+    for (; n; p += 32, n -= 32) {
+        hacc[0] = hashRound(hacc[0], read64(p + 0));
+        hacc[1] = hashRound(hacc[1], read64(p + 8));
+        hacc[2] = hashRound(hacc[2], read64(p + 16));
+        hacc[3] = hashRound(hacc[3], read64(p + 24));
+    }
+}
+
+void hashUpdate(const unsigned char *p, size_t len)
+{
+    hlen += len;
+    if (hmemlen) {
+        // fill the incomplete stripe first
+        size_t add = 32 - hmemlen;
+        if (add > len)
+            add = len;
+        memcpy(hmem + hmemlen, p, add);
+        hmemlen += (int)add;
+        p += add;
+        len -= add;
+        if (hmemlen < 32)
+            return;
+        hashStripes(hmem, 32);
+        hmemlen = 0;
+    }
+    size_t stripes = len & ~(size_t)31;
+    hashStripes(p, stripes);
+    memcpy(hmem, p + stripes, len - stripes);
+    hmemlen = (int)(len - stripes);
+}
+
+uint64_t hashDigest()
+{
+    uint64_t h;
+    if (hlen >= 32) {
+        h = ROTL64(hacc[0], 1) + ROTL64(hacc[1], 7) + ROTL64(hacc[2], 12) + ROTL64(hacc[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = (h ^ hashRound(0, hacc[i])) * PRIME64_1 + PRIME64_4;
+    } else
+        h = PRIME64_5;
+    h += hlen;
+
+    const unsigned char *p = hmem;
+    int n = hmemlen;
+    for (; n >= 8; p += 8, n -= 8) {
+        h ^= hashRound(0, read64(p));
+        h = ROTL64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (n >= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        h ^= v * PRIME64_1;
+        h = ROTL64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n > 0; p++, n--) {
+        h ^= *p * PRIME64_5;
+        h = ROTL64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+void writeFingerprint()
+{
+    // same format as the *sum tools
+    fprintf(fpo, "%016llx  %s\n", (unsigned long long)hashDigest(), inputfile);
+}
+
 ///////////////////////////////////////////
-void openFile()
+#define MAXSIZE             (1ll << 30)     // buffer sizes: 1G at most
+#define MAXMEMORY           (1ll << 40)     // --max-memory: 1024G at most
+
+long long parseSize(const char *arg, long long min, long long max)  // parse a size like 4096, 64k, 16M, 1G; exit on invalid value
+{
+    char *end;
+    long long size = strtoll(arg, &end, 10), unit = 1;
+    if (*end == 'k' || *end == 'K') {
+        unit = 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        unit = 1024 * 1024;
+        end++;
+    } else if (*end == 'g' || *end == 'G') {
+        unit = 1024 * 1024 * 1024;
+        end++;
+    }
+    if (end == arg || *end || size < 0 || size > max / unit || size * unit < min) {
+        fprintf(stderr, "cesu8: Error: invalid size %s (%lld..%lldG)\n", arg, min, max >> 30);
+        exit(6);
+    }
+    return size * unit;
+}
+
+void exclusive(bool given, const char *opt, const char *other)    // exit if opt follows an option it can't be used with
+{
+    if (given) {
+        fprintf(stderr, "cesu8: Error: %s can't be used with %s\n", opt, other);
+        exit(6);
+    }
+}
+
+void allocBuffers(int size)
+{
+    free(buff);
+    free(obuff);
+    bsize = size;
+    buff = malloc(bsize);
+    obuff = malloc(bsize + bsize / 2);
+    if (!buff || !obuff) {
+        fprintf(stderr, "cesu8: Error: couldn't allocate %d byte buffers\n", bsize);
+        exit(6);
+    }
+}
+
+// Batch mode (-k): an error of an input file doesn't stop cesu8, it goes on with the next file
+bool keepgoing = false;             // -k    --keep-going
+bool failarmed = false;             // failjmp is set: fail() returns to convertFile()
+jmp_buf failjmp;
+
+pthread_t mainthread;               // failjmp can be used only there (the pool's reader may open files, too)
+
+void fail(int code)                                 // stop processing the current file (the error is already reported)
+{
+    if (!failarmed || !pthread_equal(pthread_self(), mainthread))
+        exit(code);
+    longjmp(failjmp, code);
+}
+
+// Concatenated input (--concat): the parts following the first file are read as the continuation
+// of it, so a sequence split between two parts (e.g. by split -b) is converted as a whole, and
+// offsets count from the start of the first part
+bool concat = false;                // --concat
+char **concatparts;                 // parts not opened yet
+int nconcat;                        // number of concatparts
+
+int inerror;                        // error of readInput(): 1 (a part couldn't be opened) or 3 (read error)
+bool rawerror;                      // read(2) of readBytes() failed
+
+bool openInput(const char *name)                    // open name as fpi; false on error (reported)
 {
-    if (strcmp(inputfile, "-") == 0)
+    if (strcmp(name, "-") == 0)
         fpi = stdin;
     else
-        fpi = fopen(inputfile, "rb");
+        fpi = fopen(name, "rb");
     if (!fpi) {
         if (!silentio)
-            fprintf(stderr, "cesu8: Error: couldn't open %s\n", inputfile);
-        exit(1);
+            fprintf(stderr, "cesu8: Error: couldn't open %s\n", name);
+        return false;
     }
+    return true;
+}
+
+void openFile()
+{
+    if (!openInput(inputfile))
+        fail(1);
+    inerror = 0;
+    rawerror = false;
     blen = 0;
     rlen = 0;
     wlen = 0;
 
     bufpos = 0;
+
+    if (fingerprint)
+        hashReset();
 }
 
 void closeFile()
@@ -112,6 +352,58 @@ void closeFile()
         fclose(fpi);
 }
 
+unsigned long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// fread() from fpi; or read(2) if arrived is given (--latency): fread() returns only when the
+// buffer is full, so *arrived is set to the time the first byte of the read came (unless set yet)
+size_t readBytes(unsigned char *b, size_t want, unsigned long long *arrived)
+{
+    if (!arrived)
+        return fread(b, 1, want, fpi);
+    size_t got = 0;
+    while (got < want) {
+        ssize_t n = read(fileno(fpi), b + got, want - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            rawerror = (n < 0);
+            break;
+        }
+        if (!*arrived)
+            *arrived = nowNs();
+        got += n;
+    }
+    return got;
+}
+
+// Read from fpi, going on with the next part at --concat. Errors are reported and stored in
+// inerror, but not acted upon: the reader threads hand them over to the main thread.
+size_t readInput(unsigned char *b, size_t want, unsigned long long *arrived)
+{
+    size_t bts = readBytes(b, want, arrived);
+    while (bts < want && nconcat > 0 && !ferror(fpi) && !rawerror) {
+        closeFile();
+        nconcat--;
+        fpi = NULL;
+        if (!openInput(*concatparts++)) {   // (inputfile stays the first part: it names the whole input)
+            inerror = 1;
+            return bts;
+        }
+        bts += readBytes(b + bts, want - bts, arrived);
+    }
+    if (ferror(fpi) || rawerror) {
+        if (!silentio)
+            fprintf(stderr, "cesu8: Error: couldn't read from %s\n", inputfile);
+        inerror = 3;
+    }
+    return bts;
+}
+
 void openOutput(const char *file)
 {
     if (fpo != stdout) {
@@ -136,26 +428,486 @@ void openOutput(const char *file)
     }
 }
 
-void writeBuff(size_t len)
+////////////////////////////////////////////
+// Read-ahead and write-behind (--max-memory): a reader thread reads the input ahead, and a writer
+// thread writes the output behind the conversion, using the buffers of one pool. The pool is
+// allocated once, its size is the memory budget: when all buffers are in use (e.g. the output
+// stalls on a slow disk) the reader blocks, so the peak memory use is predictable.
+
+#define POOL_BSIZE          (1024 * 1024)   // size of a pool buffer (at most)
+
+struct pbuf {
+    unsigned char *data;
+    size_t len;                     // bytes in data
+    size_t pos;                     // bytes already taken from data (read-ahead)
+    unsigned long long t;           // arrival of the first byte (read-ahead at --latency)
+    struct pbuf *next;
+};
+
+long long maxmemory = 0;            // --max-memory   size of the pool; 0: no read-ahead and write-behind
+bool pooled = false;                // readFile() and writeBuff() use the pool now
+size_t pbsize;                      // size of the pool buffers
+int npbufs;                         // number of the pool buffers (at least 3)
+struct pbuf *pfree;                 // free buffers
+int nfree;
+struct pbuf *pqhead, *pqtail;       // read-ahead queue
+bool pqeof;                         // reader reached the end of input (or an error: inerror is set)
+bool pqstop;                        // the file failed (-k): the reader is to stop
+struct pbuf *bqhead, *bqtail;       // write-behind queue
+bool bqclose;                       // no more output (writer thread exits when the queue is empty)
+int outerror;                       // write error of the writer thread (2): the main thread fails
+struct pbuf *wcur;                  // output buffer being filled by writeBuff()
+pthread_t reader, writer;
+pthread_mutex_t plock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pcond = PTHREAD_COND_INITIALIZER;
+
+void appendQueue(struct pbuf **head, struct pbuf **tail, struct pbuf *b)
+{
+    b->next = NULL;
+    if (*tail)
+        (*tail)->next = b;
+    else
+        *head = b;
+    *tail = b;
+}
+
+struct pbuf *takeQueue(struct pbuf **head, struct pbuf **tail)
+{
+    struct pbuf *b = *head;
+    *head = b->next;
+    if (!*head)
+        *tail = NULL;
+    return b;
+}
+
+void freeBuffer(struct pbuf *b)                     // (plock is held)
+{
+    b->next = pfree;
+    pfree = b;
+    nfree++;
+    pthread_cond_broadcast(&pcond);
+}
+
+struct pbuf *getBuffer(int keep)                    // wait for a free buffer while at most keep ones are free
+{
+    pthread_mutex_lock(&plock);
+    while (nfree <= keep)
+        pthread_cond_wait(&pcond, &plock);
+    struct pbuf *b = pfree;
+    pfree = b->next;
+    nfree--;
+    pthread_mutex_unlock(&plock);
+    b->len = 0;
+    b->pos = 0;
+    return b;
+}
+
+void *readAheadThread(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        // one free buffer is always left for writeBuff(): the conversion can't get stuck
+        struct pbuf *b = getBuffer(1);
+        b->t = 0;
+        b->len = readInput(b->data, pbsize, latency ? &b->t : NULL);
+        bool eof = (b->len < pbsize || inerror);
+
+        pthread_mutex_lock(&plock);
+        if (pqstop) {
+            freeBuffer(b);
+            pthread_mutex_unlock(&plock);
+            return NULL;
+        }
+        if (b->len)
+            appendQueue(&pqhead, &pqtail, b);
+        else
+            freeBuffer(b);
+        pqeof = eof;
+        pthread_cond_broadcast(&pcond);
+        pthread_mutex_unlock(&plock);
+        if (eof)
+            return NULL;
+    }
+}
+
+void *writeBehindThread(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&plock);
+        while (!bqhead && !bqclose)
+            pthread_cond_wait(&pcond, &plock);
+        if (!bqhead) {
+            pthread_mutex_unlock(&plock);
+            return NULL;
+        }
+        struct pbuf *b = takeQueue(&bqhead, &bqtail);
+        pthread_mutex_unlock(&plock);
+
+        // after an error the output left is dropped (the main thread isn't blocked until it fails)
+        bool failed = !outerror && fwrite(b->data, 1, b->len, fpo) < b->len;
+        if (failed && !silentio)
+            fprintf(stderr, "cesu8: Error: couldn't write %s while processing %s\n", (fpo == stdout) ? "all text" : outputfile, inputfile);
+
+        pthread_mutex_lock(&plock);
+        if (failed)
+            outerror = 2;
+        freeBuffer(b);
+        pthread_mutex_unlock(&plock);
+    }
+}
+
+size_t readPool(unsigned char *b, size_t want, unsigned long long *arrived)    // take up to want read-ahead bytes (less at the end of input only)
+{
+    size_t got = 0;
+    pthread_mutex_lock(&plock);
+    while (got < want) {
+        while (!pqhead && !pqeof)
+            pthread_cond_wait(&pcond, &plock);
+        if (!pqhead)
+            break;      // end of input
+        struct pbuf *r = pqhead;
+        if (arrived && !*arrived)
+            *arrived = r->t;
+        size_t len = r->len - r->pos;
+        if (len > want - got)
+            len = want - got;
+        memcpy(b + got, r->data + r->pos, len);
+        r->pos += len;
+        got += len;
+        if (r->pos == r->len)
+            freeBuffer(takeQueue(&pqhead, &pqtail));
+    }
+    pthread_mutex_unlock(&plock);
+    return got;
+}
+
+void startPool()                                    // start read-ahead and write-behind for the current file
+{
+    int n = (int)(maxmemory / POOL_BSIZE);
+    size_t size = (n >= 3) ? POOL_BSIZE : (size_t)(maxmemory / 3);
+    if (n < 3)
+        n = 3;
+    if (size != pbsize || n != npbufs) {
+        // (re)allocate the pool for the current budget
+        while (pfree) {
+            struct pbuf *b = pfree;
+            pfree = b->next;
+            free(b->data);
+            free(b);
+        }
+        pbsize = size;
+        npbufs = n;
+        for (nfree = 0; nfree < npbufs; nfree++) {
+            struct pbuf *b = malloc(sizeof(struct pbuf));
+            if (!b || !(b->data = malloc(pbsize))) {
+                fprintf(stderr, "cesu8: Error: couldn't allocate %lld bytes for buffers\n", maxmemory);
+                exit(6);
+            }
+            b->next = pfree;
+            pfree = b;
+        }
+    }
+    pqeof = false;
+    pqstop = false;
+    bqclose = false;
+    outerror = 0;
+    if (pthread_create(&reader, NULL, readAheadThread, NULL) != 0 || pthread_create(&writer, NULL, writeBehindThread, NULL) != 0) {
+        fprintf(stderr, "cesu8: Error: couldn't start threads\n");
+        exit(6);
+    }
+    pooled = true;
+}
+
+void stopPool()                                     // wait for the end of writing the current file
+{
+    pthread_mutex_lock(&plock);
+    if (wcur && wcur->len)
+        appendQueue(&bqhead, &bqtail, wcur);
+    else if (wcur)
+        freeBuffer(wcur);
+    wcur = NULL;
+    bqclose = true;
+    // the read-ahead left after a failure is dropped (a blocked reader can go on then):
+    while (pqhead)
+        freeBuffer(takeQueue(&pqhead, &pqtail));
+    pqstop = true;
+    pthread_cond_broadcast(&pcond);
+    pthread_mutex_unlock(&plock);
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    pooled = false;
+}
+
+void writePool(const unsigned char *b, size_t len)  // queue output bytes for the writer thread
+{
+    while (len) {
+        if (!wcur)
+            wcur = getBuffer(0);
+        size_t add = pbsize - wcur->len;
+        if (add > len)
+            add = len;
+        memcpy(wcur->data + wcur->len, b, add);
+        wcur->len += add;
+        b += add;
+        len -= add;
+        if (wcur->len == pbsize) {
+            pthread_mutex_lock(&plock);
+            appendQueue(&bqhead, &bqtail, wcur);
+            pthread_cond_broadcast(&pcond);
+            int err = outerror;
+            pthread_mutex_unlock(&plock);
+            wcur = NULL;
+            if (err) {
+                stopPool();
+                fail(err);
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////
+// Read-to-write latency (--latency): every chunk read by readFile() is timestamped by the arrival
+// of its first byte (the input is read by read(2) then, see readBytes()), and when
+// the last byte of the chunk is handed over to the output (writeBuff()), the time it spent in
+// cesu8 is recorded in a log-linear (HDR-like) histogram. The histogram is reported to stderr at
+// exit, and on SIGUSR2. (Output buffered by stdio or by --max-memory is not tracked further.)
+
+#define LAT_SUBBITS         4       // 16 linear sub-buckets per power of two: ~6% resolution
+#define LAT_MARKS           64      // chunks waiting for their output at most (older ones are merged)
+
+struct latmark {
+    unsigned long long end;         // input position after the chunk
+    unsigned long long t;           // time of reading the chunk (ns)
+} latmarks[LAT_MARKS];              // ring of chunks not written yet
+int latfirst, latcount;
+unsigned long long lathist[64 << LAT_SUBBITS];
+unsigned long long latn, latsum, latmin, latmax;
+volatile sig_atomic_t latreport;    // SIGUSR2 arrived: report at the next safe point
+
+int latBucket(unsigned long long v)
 {
-    if (len) {
-        size_t wrn = fwrite(inverse ? obuff : buff, 1, len, fpo);
+    if (v < (1u << LAT_SUBBITS))
+        return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    int sub = (int)(v >> (e - LAT_SUBBITS)) & ((1 << LAT_SUBBITS) - 1);
+    return ((e - LAT_SUBBITS + 1) << LAT_SUBBITS) + sub;
+}
+
+unsigned long long latBucketStart(int b)
+{
+    int g = b >> LAT_SUBBITS, sub = b & ((1 << LAT_SUBBITS) - 1);
+    return g ? (unsigned long long)((1 << LAT_SUBBITS) + sub) << (g - 1) : (unsigned long long)sub;
+}
+
+void latencyRead(unsigned long long end, unsigned long long t)  // a chunk ending at input position end is read (its first byte came at t)
+{
+    if (latcount == LAT_MARKS) {
+        // merge into the newest one: its end moves on, the time of the older read is kept
+        latmarks[(latfirst + latcount - 1) % LAT_MARKS].end = end;
+        return;
+    }
+    struct latmark *m = &latmarks[(latfirst + latcount++) % LAT_MARKS];
+    m->end = end;
+    m->t = t;
+}
+
+void latencyWritten(unsigned long long pos)         // the input is converted and written up to pos
+{
+    unsigned long long now = 0;
+    while (latcount && latmarks[latfirst].end <= pos) {
+        if (!now)
+            now = nowNs();
+        unsigned long long v = now - latmarks[latfirst].t;
+        lathist[latBucket(v)]++;
+        if (!latn || v < latmin)
+            latmin = v;
+        if (v > latmax)
+            latmax = v;
+        latsum += v;
+        latn++;
+        latfirst = (latfirst + 1) % LAT_MARKS;
+        latcount--;
+    }
+}
+
+unsigned long long latPercentile(double p)          // the highest value of the bucket of the percentile p
+{
+    unsigned long long want = (unsigned long long)(p / 100.0 * latn + 0.5), sum = 0;
+    if (want < 1)
+        want = 1;
+    for (int b = 0; b < (64 << LAT_SUBBITS); b++) {
+        sum += lathist[b];
+        if (sum >= want) {
+            unsigned long long v = latBucketStart(b + 1) - 1;
+            return v < latmax ? v : latmax;
+        }
+    }
+    return latmax;
+}
+
+void writeLatency()
+{
+    static const double ps[] = {50, 90, 99, 99.9, 99.99, 100};
+    if (!latn) {
+        fprintf(stderr, "cesu8: read-to-write latency: no chunks written yet\n");
+        return;
+    }
+    fprintf(stderr, "cesu8: read-to-write latency of %llu chunks (us): min %.1f, mean %.1f, max %.1f\n",
+                    latn, latmin / 1000.0, (double)latsum / latn / 1000.0, latmax / 1000.0);
+    fprintf(stderr, "  %10s %14s\n", "percentile", "latency (us)");
+    for (int i = 0; i < (int)(sizeof(ps) / sizeof(ps[0])); i++)
+        fprintf(stderr, "  %10.2f %14.1f\n", ps[i], latPercentile(ps[i]) / 1000.0);
+}
+
+void latencySignal(int sig)
+{
+    (void)sig;
+    latreport = 1;
+}
+
+void startLatency()
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = latencySignal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sa, NULL);
+    latency = true;
+}
+
+////////////////////////////////////////////
+// Status report on SIGUSR1: the handler only sets a flag (and tells if cesu8 is blocked in I/O);
+// the report is written at the next safe point, i.e. by readFile() or writeBytes(), or when the next
+// request (--coprocess) or file event (--watch) arrives. At -j the main thread reports while it waits
+// for the next converted chunk, too; the position is the end of the last chunk written (and with -s
+// truncated 4-byte sequences are not counted as invalid). At --watch only the bytes of the converted
+// files are counted.
+
+#define STAGE_IDLE          0
+#define STAGE_READ          1
+#define STAGE_CONVERT       2
+#define STAGE_WRITE         3
+#define STAGE_WAIT          4       // -j: waiting for the conversion threads
+
+const char *stagenames[] = {"idle", "reading", "converting", "writing", "waiting for threads"};
+volatile sig_atomic_t stage = STAGE_IDLE;
+volatile sig_atomic_t statusreq;    // SIGUSR1 arrived: report at the next safe point
+volatile sig_atomic_t sigstage;     // stage when the signal arrived
+unsigned long long starttime;       // (ns)
+unsigned long long nread;           // input bytes read
+unsigned long long nwritten;        // output bytes written (or hashed)
+unsigned long long nconverted;      // surrogate pairs or 4-byte codes converted
+unsigned long long ninvalid;        // unpaired surrogates and invalid codes found
+unsigned long long nsubst;          // codes substituted by the --map table (not counted in nconverted)
+
+void writeStatus()
+{
+    statusreq = 0;
+    double secs = (nowNs() - starttime) / 1e9;
+    fprintf(stderr, "cesu8: status: %s, stage: %s, input position: %#llx\n"
+                    "  read: %llu bytes, written: %llu bytes, converted: %llu codes, invalid: %llu codes, substituted: %llu codes\n"
+                    "  elapsed: %.2f s, throughput: %.1f MB/s\n",
+                    inputfile ? inputfile : "(no file)", stagenames[sigstage], bufpos + rlen,
+                    nread, nwritten, nconverted, ninvalid, nsubst,
+                    secs, secs > 0 ? nread / secs / 1e6 : 0.0);
+}
+
+void statusSignal(int sig)
+{
+    static const char rmsg[] = "cesu8: status: waiting for input (report follows when it arrives)\n";
+    static const char wmsg[] = "cesu8: status: waiting for output (report follows when it's written)\n";
+    (void)sig;
+    statusreq = 1;
+    sigstage = stage;
+    // blocked in I/O, the next safe point may be far: tell it now (write() is async-signal-safe)
+    if (stage == STAGE_READ) {
+        ssize_t r = write(STDERR_FILENO, rmsg, sizeof(rmsg) - 1);
+        (void)r;
+    } else if (stage == STAGE_WRITE) {
+        ssize_t r = write(STDERR_FILENO, wmsg, sizeof(wmsg) - 1);
+        (void)r;
+    }
+}
+
+void startStatus()
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = statusSignal;
+    sa.sa_flags = SA_RESTART;       // don't break fread()/fwrite()
+    sigaction(SIGUSR1, &sa, NULL);
+    starttime = nowNs();
+}
+
+void appendResponse(const unsigned char *b, size_t len)
+{
+    if (rblen + len > FRAME_MAXLEN) {
+        // (-i output may be 1.5 times longer than the request)
+        if (!silentio)
+            fprintf(stderr, "cesu8: Error: response frame longer than %llu bytes\n", FRAME_MAXLEN);
+        exit(2);
+    }
+    if (rblen + len > rbsize) {
+        size_t size = rbsize ? rbsize : BSIZE * 4;
+        while (size < rblen + len)
+            size *= 2;
+        unsigned char *nb = realloc(rbuff, size);
+        if (!nb) {
+            if (!silentio)
+                fprintf(stderr, "cesu8: Error: out of memory while processing a frame\n");
+            exit(2);
+        }
+        rbuff = nb;
+        rbsize = size;
+    }
+    memcpy(rbuff + rblen, b, len);
+    rblen += len;
+}
+
+void writeBytes(const unsigned char *b, size_t len)
+{
+    if (statusreq)
+        writeStatus();
+    nwritten += len;
+    if (len && framed) {
+        appendResponse(b, len);
+    } else if (len && fingerprint) {
+        hashUpdate(b, len);
+    } else if (len && pooled) {
+        writePool(b, len);
+    } else if (len) {
+        stage = STAGE_WRITE;
+        size_t wrn = fwrite(b, 1, len, fpo);
+        stage = STAGE_CONVERT;
         if (wrn < len) {
             if (!silentio)
                 fprintf(stderr, "cesu8: Error: couldn't write %s while processing %s\n", (fpo == stdout) ? "all text" : outputfile, inputfile);
-            exit(2);
+            fail(2);
         }
     }
 }
 
-bool readFile()                                     // read next chunk from file to buff
+void writeBuff(size_t len)
 {
-    bufpos += rlen;     // previous buff will be replaced by a new one, starting here
+    writeBytes(inverse ? obuff : buff, len);
+}
 
-    // emit already converted bytes:
+bool readFile()                                     // read next chunk from file to buff
+{
+    // emit already converted bytes (a status report there still sees bufpos + rlen):
     if (wlen)
         writeBuff(wlen);
     wlen = 0;
+    bufpos += rlen;     // previous buff will be replaced by a new one, starting here
+    if (latency) {
+        latencyWritten(bufpos);
+        if (latreport) {
+            latreport = 0;
+            writeLatency();
+        }
+    }
 
     // unprocessed bytes are to be moved to the start of buff:
     if (blen > rlen)
@@ -163,13 +915,30 @@ bool readFile()                                     // read next chunk from file
     blen -= rlen;
     rlen = 0;
 
-    size_t bts = fread(buff + blen, 1, BSIZE - blen, fpi);
+    size_t want = bsize - blen;
+    if (framed && want > framelen)
+        want = framelen;        // don't read beyond the request frame
+    if (statusreq)
+        writeStatus();
+    stage = STAGE_READ;
+    unsigned long long arrived = 0;
+    size_t bts = pooled ? readPool(buff + blen, want, latency ? &arrived : NULL)
+                        : readInput(buff + blen, want, (latency && !framed) ? &arrived : NULL);
+    stage = STAGE_CONVERT;
+    nread += bts;
     blen += (int)bts;
-
-    if (ferror(fpi)) {
+    if (framed)
+        framelen -= bts;
+    if (latency && bts)
+        latencyRead(bufpos + blen, arrived ? arrived : nowNs());
+
+    // (the pool's reader sets inerror before the end of the read-ahead)
+    if (inerror && (!pooled || bts < want))
+        fail(inerror);
+    if (framed && bts < want) {
         if (!silentio)
             fprintf(stderr, "cesu8: Error: couldn't read from %s\n", inputfile);
-        exit(3);
+        fail(3);
     }
 
     return (blen > 0);  // false if no more bytes to process
@@ -178,16 +947,16 @@ bool readFile()                                     // read next chunk from file
 ////////////////////////////////////////////
 // Searching for a CESU-8 sequence:
 
-int find_U(int i)                                   // find the first byte of the 6-byte CESU-8 sequence
+int find_U(int i, int end)                          // find the first byte of the 6-byte CESU-8 sequence before end
 {
-    for (; i < blen; i++) {
+    for (; i < end; i++) {
         if (buff[i] == U_BYTE) {
             if (verbose)
                 fprintf(stderr, "CESU-8 Lead byte found at %#06llx; ", bufpos + i);
             return i;
         }
     }
-    return blen;    // return blen if not found
+    return end;     // return end if not found
 }
 
 bool is_found_1st_three(int i)                      // is it a high surrogate?
@@ -210,11 +979,209 @@ bool is_found_six(int i)
     return is_found_1st_three(i) && is_found_2nd_three(i + 3);
 }
 
+////////////////////////////////////////////
+// Code point substitution (--map <file>): the converted supplementary code points listed in the
+// file are replaced by the given text instead of their UTF-8 (or CESU-8) sequence. Lines of the file:
+//   <code point> <replacement>     e.g.  U+1F600 :-)
+// The replacement is the rest of the line (UTF-8, may be empty); it is written in the target
+// encoding, so it has to be 6 bytes at most in both UTF-8 and CESU-8 to fit in place of the
+// sequence. '#' starts a comment line.
+
+#define MAP_MAXLEN          6
+
+struct subst {
+    int uni;
+    const char *file;                       // the --map file
+    int line;
+    unsigned char len;
+    unsigned char text[MAP_MAXLEN];         // UTF-8
+    unsigned char clen;
+    unsigned char ctext[MAP_MAXLEN];        // CESU-8 (-i)
+};
+
+struct subst *maps;                 // sorted by uni
+int nmaps;
+
+size_t encodeSubst(int flags, const char *text, size_t len, unsigned char *out)    // length at out; 0: malformed, MAP_MAXLEN+1: too long
+{
+    size_t outlen = MAP_MAXLEN;
+    int status = cesu8_convert(CESU8_NORMALIZE | CESU8_STRICT | CESU8_LAST | flags, (const unsigned char *)text, &len, out, &outlen);
+    if (status == CESU8_INVALID)
+        return 0;
+    return status == CESU8_OK ? outlen : MAP_MAXLEN + 1;
+}
+
+int cmpSubst(const void *a, const void *b)
+{
+    const struct subst *x = a, *y = b;
+    return (x->uni != y->uni) ? x->uni - y->uni : x->line - y->line;
+}
+
+void loadMap(const char *file)
+{
+    FILE *fp = fopen(file, "r");
+    if (!fp) {
+        if (!silentio)
+            fprintf(stderr, "cesu8: Error: couldn't open %s\n", file);
+        exit(1);
+    }
+    char *line = NULL;
+    size_t lsize = 0;
+    ssize_t len;
+    int lineno = 0;
+    while ((len = getline(&line, &lsize, fp)) >= 0) {
+        lineno++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = 0;
+        if (len == 0 || line[0] == '#')
+            continue;
+        char *p = line;
+        if ((p[0] == 'U' || p[0] == 'u') && p[1] == '+')
+            p += 2;
+        char *e;
+        long uni = strtol(p, &e, 16);
+        if (e == p || (*e && *e != ' ' && *e != '\t') || uni < 0x10000 || uni > 0x10ffff) {
+            fprintf(stderr, "cesu8: Error: invalid code point in %s line %d (U+10000..U+10FFFF)\n", file, lineno);
+            exit(6);
+        }
+        if (*e)
+            e++;        // the separator
+        size_t tlen = strlen(e);
+        if (tlen > MAP_MAXLEN) {
+            fprintf(stderr, "cesu8: Error: replacement longer than %d bytes in %s line %d\n", MAP_MAXLEN, file, lineno);
+            exit(6);
+        }
+        struct subst m = { (int)uni, file, lineno, 0, {0}, 0, {0} };
+        size_t ulen = 0, clen = 0;
+        if (tlen > 0) {
+            ulen = encodeSubst(CESU8_C2U, e, tlen, m.text);
+            clen = encodeSubst(CESU8_U2C, e, tlen, m.ctext);
+            if (ulen == 0) {
+                fprintf(stderr, "cesu8: Error: malformed replacement in %s line %d\n", file, lineno);
+                exit(6);
+            }
+        }
+        if (ulen > MAP_MAXLEN || clen > MAP_MAXLEN) {
+            fprintf(stderr, "cesu8: Error: replacement longer than %d bytes as %s in %s line %d\n", MAP_MAXLEN,
+                    ulen > MAP_MAXLEN ? "UTF-8" : "CESU-8", file, lineno);
+            exit(6);
+        }
+        m.len = (unsigned char)ulen;
+        m.clen = (unsigned char)clen;
+        struct subst *nm = realloc(maps, sizeof(struct subst) * (nmaps + 1));
+        if (!nm) {
+            fprintf(stderr, "cesu8: Error: couldn't allocate memory for %s\n", file);
+            exit(6);
+        }
+        maps = nm;
+        maps[nmaps++] = m;
+    }
+    free(line);
+    fclose(fp);
+    qsort(maps, nmaps, sizeof(struct subst), cmpSubst);
+    for (int k = 1; k < nmaps; k++) {
+        if (maps[k].uni == maps[k - 1].uni) {
+            struct subst *a = &maps[k - 1], *b = &maps[k];
+            if (b->file != file)
+                a = b, b = &maps[k - 1];    // (report the line of the file just loaded)
+            fprintf(stderr, "cesu8: Error: U+%04X listed again in %s line %d (see %s line %d)\n", b->uni, b->file, b->line, a->file, a->line);
+            exit(6);
+        }
+    }
+}
+
+bool substitute(int uni, unsigned char *d, int skip)  // write the replacement of uni to d, skip the input sequence
+{
+    int lo = 0, hi = nmaps - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (maps[mid].uni < uni) {
+            lo = mid + 1;
+        } else if (maps[mid].uni > uni) {
+            hi = mid - 1;
+        } else {
+            if (verbose)
+                fprintf(stderr, "Unicode U+%04x (%lc) substituted\n", uni, uni);
+            int len = inverse ? maps[mid].clen : maps[mid].len;   // in the target encoding
+            memcpy(d, inverse ? maps[mid].ctext : maps[mid].text, len);
+            rlen += skip;
+            wlen += len;
+            nsubst++;
+            return true;
+        }
+    }
+    return false;
+}
+
 ////////////////////////////////////////////
 // Convert CESU-8 to UTF-8: (in place)
 
 #define COMB(a, b, bcount) ((a) << bcount) | (b)   // combine bits
 
+#ifdef BMI2_KERNELS
+/*
+ * The whole sequence is loaded as one (big endian) word, and the payload bits are gathered (PEXT)
+ * or scattered (PDEP) by a single instruction using the masks of the fix bits:
+ *
+ * CESU-8:  1110 1101   1010 vvvv   10ww wwww   1110 1101   1011 yyyy   10zz zzzz
+ * mask:    0000 0000   0000 1111   0011 1111   0000 0000   0000 1111   0011 1111   = SIX_PAYLOAD
+ * UTF-8:   1111 0VVV   10VV wwww   10ww yyyy   10zz zzzz
+ * mask:    0000 0111   0011 1111   0011 1111   0011 1111                           = FOUR_PAYLOAD
+ */
+#define SIX_PAYLOAD         0x000f3f000f3full
+#define SIX_FIXBITS         0xeda080edb080ull
+#define FOUR_PAYLOAD        0x073f3f3fu
+#define FOUR_FIXBITS        0xf0808080u
+
+bool detectBmi2()
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__builtin_cpu_supports("bmi2"))
+        return false;
+    // PEXT/PDEP are microcoded on AMD CPUs before Zen 3 (family 19h): much slower than the shifts
+    if (__get_cpuid(0, &eax, &ebx, &ecx, &edx) && ebx == 0x68747541) {        // "Auth"enticAMD
+        __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+        unsigned int family = (eax >> 8) & 0x0f;
+        if (family == 0x0f)
+            family += (eax >> 20) & 0xff;
+        if (family < 0x19)
+            return false;
+    }
+    return true;
+}
+
+__attribute__((target("bmi2")))
+int gather_six(const unsigned char *s)              // Unicode value of the 6-byte CESU-8 sequence at s
+{
+    uint64_t x = 0;
+    memcpy(&x, s, 6);
+    return (int)_pext_u64(__builtin_bswap64(x) >> 16, SIX_PAYLOAD) + 0x10000;
+}
+
+__attribute__((target("bmi2")))
+void scatter_four(int uni, unsigned char *d)        // write the 4-byte UTF-8 sequence of uni to d
+{
+    uint32_t x = __builtin_bswap32(_pdep_u32((uint32_t)uni, FOUR_PAYLOAD) | FOUR_FIXBITS);
+    memcpy(d, &x, 4);
+}
+
+__attribute__((target("bmi2")))
+int gather_four(const unsigned char *s)             // Unicode value of the 4-byte UTF-8 sequence at s
+{
+    uint32_t x;
+    memcpy(&x, s, 4);
+    return (int)_pext_u32(__builtin_bswap32(x), FOUR_PAYLOAD);
+}
+
+__attribute__((target("bmi2")))
+void scatter_six(int uni, unsigned char *d)         // write the 6-byte CESU-8 sequence of uni to d
+{
+    uint64_t x = __builtin_bswap64((_pdep_u64((uint64_t)(uni - 0x10000), SIX_PAYLOAD) | SIX_FIXBITS) << 16);
+    memcpy(d, &x, 6);
+}
+#endif
+
 void convert_six()                                  // convert 6-byte CESU-8 at rlen to 4-byte UTF-8 at wlen
 {
 /*
@@ -224,6 +1191,20 @@ void convert_six()                                  // convert 6-byte CESU-8 at
  * output:  1111 0VVV               10VV wwww               10ww yyyy   10zz zzzz
  *          p                       q                       r           s
  */
+#ifdef BMI2_KERNELS
+    if (usebmi2) {
+        int uni = gather_six(buff + rlen);
+        if (nmaps && substitute(uni, buff + wlen, 6))
+            return;
+        if (verbose)
+            fprintf(stderr, "Unicode U+%04x (%lc)\n", uni, uni);
+        scatter_four(uni, buff + wlen);
+        rlen += 6;
+        wlen += 4;
+        nconverted++;
+        return;
+    }
+#endif
     int vvvv = buff[rlen + 1] & (0xff - V_BYTE_FIXMASK);
     int wwwwww = buff[rlen + 2] & (0xff - W_BYTE_FIXMASK);
     int yyyy = buff[rlen + 4] & (0xff - Y_BYTE_FIXMASK);
@@ -233,6 +1214,9 @@ void convert_six()                                  // convert 6-byte CESU-8 at
 
     // Unicode value: V VVVV wwww wwyy yyzz zzzz
 
+    if (nmaps && substitute(COMB(COMB(COMB(VVVVV, wwwwww, 6), yyyy, 4), zzzzzz, 6), buff + wlen, 6))
+        return;
+
     if (verbose) {
         int uni = COMB(COMB(COMB(VVVVV, wwwwww, 6), yyyy, 4), zzzzzz, 6);
         fprintf(stderr, "Unicode U+%04x (%lc)\n", uni, uni);
@@ -245,21 +1229,22 @@ void convert_six()                                  // convert 6-byte CESU-8 at
 
     rlen += 6;
     wlen += 4;
+    nconverted++;
 }
 
 ////////////////////////////////////////////
 // Searching for a UTF-8 sequence:
 
-int find_P(int i)                                   // find the first byte of the 4-byte UTF-8 sequence
+int find_P(int i, int end)                          // find the first byte of the 4-byte UTF-8 sequence before end
 {
-    for (; i < blen; i++) {
+    for (; i < end; i++) {
         if ((buff[i] & P_BYTE_FIXMASK) == P_BYTE_FIXVAL) {
             if (verbose)
                 fprintf(stderr, "UTF-8 Lead byte found at %#06llx; ", bufpos + i);
             return i;
         }
     }
-    return blen;    // return blen if not found
+    return end;     // return end if not found
 }
 
 bool is_found_four(int i)                           // is it indeed a 4-byte UTF-8 sequence?
@@ -283,6 +1268,23 @@ void convert_four()                                  // convert 4-byte UTF-8 at
  * output:  1110 1101   1010 vvvv   10ww wwww   1110 1101   1011 yyyy   10zz zzzz
  *          u           v           w           x           y           z
  */
+#ifdef BMI2_KERNELS
+    if (usebmi2) {
+        int uni = gather_four(buff + rlen);
+        if (uni >= 0x10000 && uni <= 0x10ffff) {
+            if (nmaps && substitute(uni, obuff + wlen, 4))
+                return;
+            if (verbose)
+                fprintf(stderr, "Unicode U+%04x (%lc)\n", uni, uni);
+            scatter_six(uni, obuff + wlen);
+            rlen += 4;
+            wlen += 6;
+            nconverted++;
+            return;
+        }
+        // invalid codes are reported below
+    }
+#endif
     int VVV = buff[rlen + 0] & (0xff - P_BYTE_FIXMASK);
     int VVwwww = buff[rlen + 1] & (0xff - QRS_BYTE_FIXMASK);
     int wwyyyy = buff[rlen + 2] & (0xff - QRS_BYTE_FIXMASK);
@@ -298,6 +1300,7 @@ void convert_four()                                  // convert 4-byte UTF-8 at
 
     if (vvvv < 0 || vvvv > 0x0f) {
         // overlong UTF-8 (<0) or too large Unicode (>0xf)
+        ninvalid++;
         if (!silent) {
             int uni = COMB(COMB(COMB(VVVVV, wwwwww, 6), yyyy, 4), zzzzzz, 6);
             fprintf(stderr, "cesu8: Warning: Invalid 4-byte U+%06x found at %#06llx! %s\n"
@@ -317,6 +1320,9 @@ void convert_four()                                  // convert 4-byte UTF-8 at
         return;
     }
 
+    if (nmaps && substitute(COMB(COMB(COMB(VVVVV, wwwwww, 6), yyyy, 4), zzzzzz, 6), obuff + wlen, 4))
+        return;
+
     if (verbose) {
         int uni = COMB(COMB(COMB(VVVVV, wwwwww, 6), yyyy, 4), zzzzzz, 6);
         fprintf(stderr, "Unicode U+%04x (%lc)\n", uni, uni);
@@ -324,13 +1330,14 @@ void convert_four()                                  // convert 4-byte UTF-8 at
 
     obuff[wlen + 0] = U_BYTE;                                               // u
     obuff[wlen + 1] = V_BYTE_FIXVAL | vvvv;                                 // v
-    obuff[wlen + 2] = V_BYTE_FIXVAL | wwwwww;                               // w
+    obuff[wlen + 2] = W_BYTE_FIXVAL | wwwwww;                               // w
     obuff[wlen + 3] = U_BYTE;                                               // x
     obuff[wlen + 4] = Y_BYTE_FIXVAL | yyyy;                                 // y
     obuff[wlen + 5] = buff[rlen + 3];                                       // z
 
     rlen += 4;
     wlen += 6;
+    nconverted++;
 }
 
 ////////////////////////////////////////////
@@ -369,29 +1376,28 @@ int utf8_three()                                    // return the Unicode value
 void convertCesuBuff()                          // CESU-8 to UTF-8
 {
     // we know that rlen == wlen == 0 (because readFile zeroes them)
-    if (blen < 6) {
-        // Short file, or this is the last (short) chunk of the file after a CESU-8 sequence close to the end of file
-        step_to(blen);
-        return;
-    }
+    bool last = blen < bsize;   // buff is filled up, unless the end of the file is reached
     while (rlen < blen) {
-        int upos = find_U(rlen);
-        // upos is the position of the first byte of a potential 6-byte CESU-8 sequence (u), or == blen if not found
+        int bend = (blen - rlen > blocksize) ? rlen + blocksize : blen;     // end of the current block
+        int upos = find_U(rlen, bend);
+        // upos is the position of the first byte of a potential 6-byte CESU-8 sequence (u), or == bend if not found
         step_to(upos);      // move rlen to upos and write the unmodified rlen..upos range to wlen
         // rlen == upos now (and the string is written up to wlen)
         // if the leader byte found, check if this is indeed a CESU-8 sequence:
-        if (rlen != blen) {
-            if (rlen + 6 > blen)
+        if (rlen != bend) {
+            if (rlen + 6 > blen && !last)
                 return;     // there are not enough bytes there, load next chunk
-            if (is_found_six(rlen)) {
+            if (rlen + 6 <= blen && is_found_six(rlen)) {
                 // convert this CESU-8 code point to UTF-8
                 convert_six();  //  (from buff+rlen to buff+wlen)
-                // rlen and wlen updated
+                // rlen, wlen and nconverted updated
             } else {
-                bool high = is_found_1st_three(rlen);
-                bool low = is_found_2nd_three(rlen);
+                // (an unpaired surrogate can be close to the end of the file; a truncated one is left unchanged)
+                bool high = rlen + 3 <= blen && is_found_1st_three(rlen);
+                bool low = rlen + 3 <= blen && is_found_2nd_three(rlen);
                 if (high || low) {
                     // Oops, invalid code!
+                    ninvalid++;
                     if (!silent)
                         fprintf(stderr, "cesu8: Warning: Unpaired %s surrogate U+%04x found at %#06llx! %s\n"
                                                         , high ? "High" : " Low"
@@ -427,12 +1433,13 @@ void convertUtfBuff()                           // UTF-8 to CESU-8
         return;
     }
     while (rlen < blen) {
-        int upos = find_P(rlen);
-        // upos is the position of the first byte of a 4-byte UTF-8 sequence (p), or == blen if not found
+        int bend = (blen - rlen > blocksize) ? rlen + blocksize : blen;     // end of the current block
+        int upos = find_P(rlen, bend);
+        // upos is the position of the first byte of a 4-byte UTF-8 sequence (p), or == bend if not found
         step_to(upos);      // move rlen to upos and write the unmodified rlen..upos range to wlen
         // rlen == upos now (and the string is written up to wlen)
         // if the leader byte found, check if this is indeed a CESU-8 sequence:
-        if (rlen != blen) {
+        if (rlen != bend) {
             if (rlen + 4 > blen)
                 return;     // there are not enough bytes there, load next chunk
             if (is_found_four(rlen)) {
@@ -442,6 +1449,7 @@ void convertUtfBuff()                           // UTF-8 to CESU-8
                 // (In case of wrong 4-byte code '?' is converted)
             } else {
                 // It should not happen... happens only if the UTF-8 encoding is buggy
+                ninvalid++;
                 if (!silent)
                     fprintf(stderr, "cesu8: Warning: Invalid UTF-8 sequence found at %#04llx! Left unchanged\n", bufpos + rlen);
                 step_to(rlen + 1);
@@ -451,13 +1459,1317 @@ void convertUtfBuff()                           // UTF-8 to CESU-8
 }
 
 ////////////////////////////////////////////
+// Normalization (--normalize): UTF-8 and CESU-8 input (even mixed), converted to the target encoding
+// by libcesu8 in one pass; malformed sequences (unpaired surrogates, invalid or overlong codes,
+// stray bytes) are left unchanged, or converted to '?' (-f) or U+FFFD (--replace), or stop the
+// conversion (--strict).
 
-int main(int argc, char **argv)
+int normalize = 0;                  // --normalize   CESU8_NORMALIZE (| CESU8_U2C for CESU-8 output); 0: off
+bool replace = false;               // --replace
+bool strict = false;                // --strict
+
+void normalizeBuff()
+{
+    int flags = normalize | (fixcode ? CESU8_FIX : 0) | (replace ? CESU8_REPLACE : 0) | (strict ? CESU8_STRICT : 0);
+    if (blen < bsize)
+        flags |= CESU8_LAST;    // buff is filled up, unless the end of the file is reached
+    while (rlen < blen) {
+        size_t inlen = blen - rlen;
+        size_t outlen = bsize + bsize / 2;
+        int status = cesu8_convert(flags, buff + rlen, &inlen, obuff, &outlen);
+        rlen += inlen;
+        writeBytes(obuff, outlen);
+        if (status == CESU8_INCOMPLETE)
+            return;     // load next chunk
+        if (status == CESU8_INVALID) {
+            if (!silent)
+                fprintf(stderr, "cesu8: Error: Malformed sequence found at %#06llx in %s\n", bufpos + rlen, inputfile);
+            fail(7);
+        }
+    }
+}
+
+////////////////////////////////////////////
+// Single-byte charset input (--from latin1|cp1252): every byte is a BMP character, so the UTF-8
+// and the CESU-8 output are the same. ASCII is copied 8 bytes at once, the upper half is looked up
+// in a table of the UTF-8 sequences (2 or 3 bytes).
+
+// Windows-1252 0x80..0x9f (the undefined 0x81, 0x8d, 0x8f, 0x90, 0x9d are kept as C1 controls):
+const unsigned short cp1252[32] = {
+    0x20ac, 0x0081, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021, 0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008d, 0x017d, 0x008f,
+    0x0090, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014, 0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x009d, 0x017e, 0x0178
+};
+
+bool sbcs = false;                  // --from   input is a single-byte charset
+unsigned char sbcsmap[128][4];      // UTF-8 sequence of 0x80..0xff, its length in [3]
+
+void setCharset(bool win)
+{
+    for (int c = 0x80; c <= 0xff; c++) {
+        int uni = (win && c < 0xa0) ? cp1252[c - 0x80] : c;
+        unsigned char *d = sbcsmap[c - 0x80];
+        if (uni < 0x800) {
+            d[0] = 0xc0 | (uni >> 6);
+            d[1] = 0x80 | (uni & 0x3f);
+            d[3] = 2;
+        } else {
+            d[0] = 0xe0 | (uni >> 12);
+            d[1] = 0x80 | ((uni >> 6) & 0x3f);
+            d[2] = 0x80 | (uni & 0x3f);
+            d[3] = 3;
+        }
+    }
+    sbcs = true;
+}
+
+void convertSbcsBuff()                          // Latin-1 or Windows-1252 to UTF-8 (and CESU-8)
+{
+    int osize = bsize + bsize / 2;
+    while (rlen < blen) {
+        // bytes surely fitting to obuff:
+        int end = rlen + (osize - wlen) / 3;
+        if (end > blen)
+            end = blen;
+        while (rlen < end) {
+            if (rlen + 8 <= end) {
+                uint64_t x;
+                memcpy(&x, buff + rlen, 8);
+                if (!(x & 0x8080808080808080ull)) {
+                    memcpy(obuff + wlen, &x, 8);
+                    rlen += 8;
+                    wlen += 8;
+                    continue;
+                }
+            }
+            unsigned char c = buff[rlen++];
+            if (c < 0x80) {
+                obuff[wlen++] = c;
+            } else {
+                const unsigned char *d = sbcsmap[c - 0x80];
+                memcpy(obuff + wlen, d, 3);
+                wlen += d[3];
+            }
+        }
+        writeBytes(obuff, wlen);
+        wlen = 0;
+    }
+}
+
+////////////////////////////////////////////
+// Profile mode (--profile): instead of converting, count what would be converted per window of
+// the input (--window bytes, default 1M) and write a CSV table or a JSON object per file:
+// surrogate pairs (6-byte CESU-8), other 0xED lead bytes (non-surrogate codes), unpaired
+// surrogates, and 4-byte UTF-8 sequences. Empty windows are listed, too, so the rows can be
+// plotted directly.
+
+#define PROFILE_CSV         1
+#define PROFILE_JSON        2
+#define PWINDOW             (1024 * 1024)   // default window size (see --window)
+
+int profile = 0;                    // --profile   PROFILE_CSV or PROFILE_JSON; 0: convert
+int pwindow = PWINDOW;              // --window
+unsigned long long pstart;          // input position of the current window
+unsigned long long pcount[4];       // counts of the current window: pairs, 0xED, unpaired, 4-byte
+int prows;                          // rows written for the current file
+bool pheader = false;               // CSV header written
+
+int find_high(int i, int end)                       // find the first byte >= 0xe0 (a 3 or 4-byte lead byte) before end
+{
+    const uint64_t HIGH_BITS = 0x8080808080808080ull;
+    for (; i + 8 <= end; i += 8) {
+        uint64_t x;
+        memcpy(&x, buff + i, 8);
+        if (x & (x << 1) & (x << 2) & HIGH_BITS)
+            break;      // (the shifted bits of a byte may flag the next one, too: checked byte by byte)
+    }
+    for (; i < end; i++)
+        if (buff[i] >= 0xe0)
+            return i;
+    return end;
+}
+
+void profileRow(unsigned long long len)             // write the counts of the current window
+{
+    if (profile == PROFILE_CSV)
+        fprintf(fpo, "%s,%llu,%llu,%llu,%llu,%llu,%llu\n", inputfile, pstart, len, pcount[0], pcount[1], pcount[2], pcount[3]);
+    else
+        fprintf(fpo, "%s[%llu,%llu,%llu,%llu,%llu,%llu]", prows ? "," : "", pstart, len, pcount[0], pcount[1], pcount[2], pcount[3]);
+    prows++;
+    pstart += len;
+    memset(pcount, 0, sizeof(pcount));
+}
+
+void profileTo(unsigned long long pos)              // write the windows ending at or before pos
+{
+    while (pos >= pstart + pwindow)
+        profileRow(pwindow);
+}
+
+void profileStart()
+{
+    pstart = 0;
+    prows = 0;
+    memset(pcount, 0, sizeof(pcount));
+    if (profile == PROFILE_CSV && !pheader) {
+        fprintf(fpo, "file,offset,length,pairs,non_surrogate_ed,unpaired,four_byte\n");
+        pheader = true;
+    } else if (profile == PROFILE_JSON) {
+        fprintf(fpo, "{\"file\":\"");
+        for (const char *c = inputfile; *c; c++)
+            fprintf(fpo, (*c == '"' || *c == '\\') ? "\\%c" : ((unsigned char)*c < 0x20) ? "\\u%04x" : "%c", *c);
+        fprintf(fpo, "\",\"window\":%d,\"columns\":[\"offset\",\"length\",\"pairs\",\"non_surrogate_ed\",\"unpaired\",\"four_byte\"],\"rows\":[", pwindow);
+    }
+}
+
+void profileEnd()                                   // (bufpos is the file size after the last readFile())
+{
+    profileTo(bufpos);
+    if (bufpos > pstart || !prows)
+        profileRow(bufpos - pstart);
+    if (profile == PROFILE_JSON)
+        fprintf(fpo, "]}\n");
+}
+
+void profileBuff()
+{
+    bool last = (blen < 6);     // this is the end of the file (see convertCesuBuff)
+    while (rlen < blen) {
+        int i = find_high(rlen, blen);
+        if (i == blen) {
+            rlen = blen;
+            break;
+        }
+        profileTo(bufpos + i);
+        int need = (buff[i] == U_BYTE) ? 6 : ((buff[i] & P_BYTE_FIXMASK) == P_BYTE_FIXVAL) ? 4 : 1;
+        if (i + need > blen && !last) {
+            rlen = i;
+            return;     // load next chunk
+        }
+        if (need == 6) {
+            if (i + 6 <= blen && is_found_six(i)) {
+                pcount[0]++;
+                i += 6;
+            } else if (i + 3 <= blen && (is_found_1st_three(i) || is_found_2nd_three(i))) {
+                pcount[2]++;
+                i += 3;
+            } else {
+                pcount[1]++;
+                i += 1;
+            }
+        } else if (need == 4 && i + 4 <= blen && is_found_four(i)) {
+            pcount[3]++;
+            i += 4;
+        } else {
+            i += 1;
+        }
+        rlen = i;
+    }
+}
+
+////////////////////////////////////////////
+// Coprocess mode (--coprocess): many independent texts are converted without respawning cesu8.
+//
+// Request frame on stdin:   1 byte flags, 4 byte length (big endian), the text to convert
+// Response frame on output: 1 byte flags (same as the request's), 4 byte length, the converted text
+// Each response is flushed as soon as it's ready. The coprocess ends at the end of stdin.
+// A response that doesn't fit in a frame (4G-1 bytes) stops cesu8 (exit code 2).
+
+#define FRAME_INVERSE       0x01    // convert UTF-8 to CESU-8 (-i)
+#define FRAME_FIX           0x02    // fix unpaired surrogates and invalid 4-byte codes (-f)
+
+void runCoprocess()
+{
+    bool inv = inverse;
+    bool fix = fixcode;
+    unsigned char hdr[5];
+
+    fpi = stdin;
+    framed = true;
+    for (;;) {
+        stage = STAGE_READ;     // (waiting for the next request)
+        size_t hlen = fread(hdr, 1, sizeof(hdr), fpi);
+        stage = STAGE_CONVERT;
+        if (hlen < sizeof(hdr))
+            break;
+        inverse = (hdr[0] & FRAME_INVERSE) != 0;
+        fixcode = (hdr[0] & FRAME_FIX) != 0;
+        framelen = (unsigned long)hdr[1] << 24 | (unsigned long)hdr[2] << 16 | hdr[3] << 8 | hdr[4];
+
+        blen = 0;
+        rlen = 0;
+        wlen = 0;
+        bufpos = 0;
+        rblen = 0;
+        while (readFile()) {
+            if (inverse)
+                convertUtfBuff();       // UTF-8 to CESU-8
+            else
+                convertCesuBuff();      // CESU-8 to UTF-8
+        }
+
+        hdr[1] = (unsigned char)(rblen >> 24);
+        hdr[2] = (unsigned char)(rblen >> 16);
+        hdr[3] = (unsigned char)(rblen >> 8);
+        hdr[4] = (unsigned char)rblen;
+        if (fwrite(hdr, 1, sizeof(hdr), fpo) < sizeof(hdr) || fwrite(rbuff, 1, rblen, fpo) < rblen || fflush(fpo) != 0) {
+            if (!silentio)
+                fprintf(stderr, "cesu8: Error: couldn't write %s\n", (fpo == stdout) ? "response" : outputfile);
+            exit(2);
+        }
+    }
+    if (ferror(fpi)) {
+        if (!silentio)
+            fprintf(stderr, "cesu8: Error: couldn't read from %s\n", inputfile);
+        exit(3);
+    }
+    framed = false;
+    inverse = inv;
+    fixcode = fix;
+}
+
+////////////////////////////////////////////
+// CPU limits and pinning:
+
+int effectiveCpus()                                 // number of CPUs we may really use
+{
+    // CPUs we are allowed to run on (cpuset, taskset):
+    cpu_set_t set;
+    int cpus = (sched_getaffinity(0, sizeof(set), &set) == 0) ? CPU_COUNT(&set) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    // CPU quota of our cgroup (v2) and its ancestors: cpu.max is "<quota> <period>" or "max <period>"
+    char path[PATH_MAX + 16] = "/sys/fs/cgroup";
+    char line[PATH_MAX];
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            if (strncmp(line, "0::", 3) == 0) {     // the cgroup v2 entry
+                line[strcspn(line, "\n")] = 0;
+                snprintf(path, sizeof(path), "/sys/fs/cgroup%s", line + 3);
+            }
+        }
+        fclose(fp);
+    }
+    for (;;) {
+        size_t len = strlen(path);
+        if (len > 1 && path[len - 1] == '/')
+            path[--len] = 0;
+        char file[PATH_MAX + 32];
+        snprintf(file, sizeof(file), "%s/cpu.max", path);
+        FILE *cm = fopen(file, "r");
+        if (cm) {
+            char quota[32];
+            long period;
+            if (fscanf(cm, "%31s %ld", quota, &period) == 2 && strcmp(quota, "max") != 0 && period > 0) {
+                long limit = (atol(quota) + period - 1) / period;
+                if (limit < cpus)
+                    cpus = (int)limit;
+            }
+            fclose(cm);
+        }
+        if (strcmp(path, "/sys/fs/cgroup") == 0)
+            break;
+        char *slash = strrchr(path, '/');
+        if (!slash || slash == path)
+            break;
+        *slash = 0;     // check the parent cgroup, too
+    }
+    return (cpus < 1) ? 1 : cpus;
+}
+
+int pincpus[CPU_SETSIZE];           // --pin   the first CPU is for the I/O threads, the others for conversion threads
+int npincpus;
+
+void parseCpus(const char *arg)                     // parse a CPU list like 0,2-5; exit on invalid value
+{
+    const char *p = arg;
+    npincpus = 0;
+    while (*p) {
+        char *end;
+        long from = strtol(p, &end, 10), to = from;
+        if (end != p && *end == '-') {
+            p = end + 1;
+            to = strtol(p, &end, 10);
+        }
+        if (end == p || from < 0 || to < from || to >= CPU_SETSIZE || (*end && *end != ',')) {
+            fprintf(stderr, "cesu8: Error: invalid CPU list %s\n", arg);
+            exit(6);
+        }
+        for (long c = from; c <= to && npincpus < CPU_SETSIZE; c++)
+            pincpus[npincpus++] = (int)c;
+        p = *end ? end + 1 : end;
+    }
+}
+
+void pinThread(int worker)                          // pin the calling thread; worker < 0: an I/O thread
+{
+    if (npincpus == 0)
+        return;
+    int cpu = (worker < 0 || npincpus == 1) ? pincpus[0] : pincpus[1 + worker % (npincpus - 1)];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0 && !silent)
+        fprintf(stderr, "cesu8: Warning: couldn't pin a thread to CPU %d\n", cpu);
+}
+
+////////////////////////////////////////////
+// Threaded conversion (-j): a reader thread loads the file in chunks, conversion threads convert
+// them by libcesu8 (the global buffers above belong to the main thread), and the main thread
+// writes the converted chunks in order. Codes are converted as usual, but not reported one by one;
+// the invalid ones found by a conversion thread are listed in the chunk, and the main thread warns
+// about them when it writes the chunk, so the warnings come in the order of the input.
+
+#define TCHUNK              (1024 * 1024)   // input bytes per chunk
+#define TCARRY              8               // a chunk is cut before a sequence within its last TCARRY bytes
+
+enum { CHUNK_FREE, CHUNK_READ, CHUNK_CONVERTING, CHUNK_DONE };
+
+struct chunk {
+    unsigned char *in;              // TCHUNK bytes
+    unsigned char *out;             // TCHUNK + TCHUNK / 2 bytes
+    size_t inlen;
+    size_t outlen;
+    unsigned long long pos;         // offset of the chunk in the input
+    size_t *bad;                    // offsets of the invalid codes in the chunk
+    size_t nbad;
+    size_t nfixed;                  // invalid codes converted to '?' or copied (not the truncated ones)
+    size_t badsize;                 // allocated size of bad
+    bool last;                      // the last chunk of the file
+    int state;
+};
+
+int threads = 0;                    // -j    conversion threads; 0: no threaded conversion
+struct chunk *chunks;               // ring of 2 chunks per conversion thread
+int nchunks;
+unsigned long long convseq;         // next chunk to convert
+bool convdone;                      // the last chunk is taken by a conversion thread
+int convflags;                      // libcesu8 flags of the conversion
+pthread_mutex_t tlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tcond = PTHREAD_COND_INITIALIZER;
+
+void waitChunk(struct chunk *c, int state)
+{
+    pthread_mutex_lock(&tlock);
+    while (c->state != state)
+        pthread_cond_wait(&tcond, &tlock);
+    pthread_mutex_unlock(&tlock);
+}
+
+void waitConverted(struct chunk *c)                 // (main thread) wait for c to be converted, report the status meanwhile
+{
+    stage = STAGE_WAIT;
+    pthread_mutex_lock(&tlock);
+    while (c->state != CHUNK_DONE) {
+        if (statusreq) {
+            pthread_mutex_unlock(&tlock);
+            writeStatus();
+            pthread_mutex_lock(&tlock);
+            continue;
+        }
+        // (the signal handler can't wake the thread: look at statusreq 10 times a second)
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&tcond, &tlock, &ts);
+    }
+    pthread_mutex_unlock(&tlock);
+    stage = STAGE_CONVERT;
+}
+
+void setChunk(struct chunk *c, int state)
+{
+    pthread_mutex_lock(&tlock);
+    c->state = state;
+    pthread_cond_broadcast(&tcond);
+    pthread_mutex_unlock(&tlock);
+}
+
+size_t safeCut(const unsigned char *b, size_t len)  // where to cut the chunk without splitting a sequence
+{
+    for (size_t p = len - 1; p > len - TCARRY; p--) {
+        if ((b[p] & QRS_BYTE_FIXMASK) == QRS_BYTE_FIXVAL) {
+            if ((b[p - 1] & QRS_BYTE_FIXMASK) == QRS_BYTE_FIXVAL && (b[p - 2] & QRS_BYTE_FIXMASK) == QRS_BYTE_FIXVAL
+                    && (b[p - 3] & QRS_BYTE_FIXMASK) == QRS_BYTE_FIXVAL)
+                return p;   // stray byte: no sequence has more than 3 continuation bytes
+            continue;       // within a sequence
+        }
+        if (!inverse && b[p] == X_BYTE && b[p - 3] == U_BYTE && (b[p - 2] & V_BYTE_FIXMASK) == V_BYTE_FIXVAL
+                && (p + 1 == len || (b[p + 1] & Y_BYTE_FIXMASK) == Y_BYTE_FIXVAL))
+            continue;       // the low surrogate of a CESU-8 pair
+        return p;
+    }
+    return len - TCARRY;    // (not reached: there is a lead byte or a stray byte within TCARRY bytes)
+}
+
+void *readerThread(void *arg)
+{
+    unsigned char carry[TCARRY];
+    size_t carrylen = 0;
+    unsigned long long pos = 0;
+
+    (void)arg;
+    pinThread(-1);
+    for (unsigned long long seq = 0; ; seq++) {
+        struct chunk *c = &chunks[seq % nchunks];
+        waitChunk(c, CHUNK_FREE);
+
+        memcpy(c->in, carry, carrylen);
+        size_t bts = readInput(c->in + carrylen, TCHUNK - carrylen, NULL);
+        __atomic_fetch_add(&nread, bts, __ATOMIC_RELAXED);     // (for the status report only)
+        size_t len = carrylen + bts;
+        c->last = (len < TCHUNK || inerror);    // (convertThreaded() fails after the threads stop)
+        c->inlen = c->last ? len : safeCut(c->in, len);
+        c->pos = pos;
+        pos += c->inlen;
+        carrylen = len - c->inlen;
+        memcpy(carry, c->in + c->inlen, carrylen);
+
+        setChunk(c, CHUNK_READ);
+        if (c->last)
+            return NULL;
+    }
+}
+
+void addBad(struct chunk *c, size_t pos)
+{
+    if (c->nbad == c->badsize) {
+        size_t n = c->badsize ? c->badsize * 2 : 64;
+        size_t *nb = realloc(c->bad, n * sizeof(size_t));
+        if (!nb) {
+            fprintf(stderr, "cesu8: Error: couldn't allocate memory for warnings\n");
+            exit(6);
+        }
+        c->bad = nb;
+        c->badsize = n;
+    }
+    c->bad[c->nbad++] = pos;
+}
+
+int cmpOffset(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+void convertChecked(struct chunk *c)                // convert c, listing the invalid codes in it
+{
+    c->nbad = 0;
+    if (inverse && !silent) {
+        // 4-byte lead bytes without their continuation bytes (libcesu8 copies them silently);
+        // 32 bytes are checked at once for 0xf0..0xff:
+        const unsigned char *b = c->in;
+        size_t len = c->inlen;
+        for (size_t i = 0; i < len; ) {
+            if (i + 32 <= len) {
+                uint64_t x[4];
+                memcpy(x, b + i, 32);
+                uint64_t m = 0;
+                for (int k = 0; k < 4; k++)
+                    m |= x[k] & (x[k] << 1) & (x[k] << 2) & (x[k] << 3);
+                if (!(m & 0x8080808080808080ull)) {
+                    i += 32;
+                    continue;
+                }
+            }
+            for (size_t e = (i + 32 < len) ? i + 32 : len; i < e; i++) {
+                if ((b[i] & P_BYTE_FIXMASK) != P_BYTE_FIXVAL || (c->last && i + 4 > len))
+                    continue;       // (a partial sequence at the end of the file is not reported)
+                if (i + 4 > len || (b[i + 1] & QRS_BYTE_FIXMASK) != QRS_BYTE_FIXVAL
+                        || (b[i + 2] & QRS_BYTE_FIXMASK) != QRS_BYTE_FIXVAL || (b[i + 3] & QRS_BYTE_FIXMASK) != QRS_BYTE_FIXVAL)
+                    addBad(c, i);
+            }
+        }
+    }
+    size_t truncated = c->nbad;
+
+    // unpaired surrogates and invalid 4-byte codes stop the conversion at CESU8_STRICT:
+    size_t in = 0, out = 0;
+    for (;;) {
+        size_t inlen = c->inlen - in, outlen = TCHUNK + TCHUNK / 2 - out;
+        int status = cesu8_convert(convflags | CESU8_LAST | CESU8_STRICT, c->in + in, &inlen, c->out + out, &outlen);
+        in += inlen;
+        out += outlen;
+        if (status != CESU8_INVALID)
+            break;
+        addBad(c, in);
+        size_t skip = inverse ? 4 : 3;
+        if (fixcode) {
+            c->out[out++] = '?';
+        } else {
+            memcpy(c->out + out, c->in + in, skip);
+            out += skip;
+        }
+        in += skip;
+    }
+    c->inlen = in;
+    c->outlen = out;
+    c->nfixed = c->nbad - truncated;
+    if (truncated && c->nbad > truncated)
+        qsort(c->bad, c->nbad, sizeof(size_t), cmpOffset);
+}
+
+void reportChunk(struct chunk *c)                   // count the codes of c, warn about the invalid ones (unless -s)
+{
+    // a pair is 2 bytes shorter in UTF-8, a '?' of -f is 2 (unpaired surrogate) or 3 bytes shorter:
+    if (inverse)
+        nconverted += (c->outlen + (fixcode ? 3 * c->nfixed : 0) - c->inlen) / 2;
+    else
+        nconverted += (c->inlen - c->outlen - (fixcode ? 2 * c->nfixed : 0)) / 2;
+    ninvalid += c->nbad;
+    if (silent)
+        return;
+
+    const char *action = fixcode ? "Converted to '?'" : "Left unchanged (see -f)";
+    for (size_t k = 0; k < c->nbad; k++) {
+        const unsigned char *s = c->in + c->bad[k];
+        unsigned long long pos = c->pos + c->bad[k];
+        if (!inverse) {
+            int uni = (s[0] & 0x0f) << 12 | (s[1] & 0x3f) << 6 | (s[2] & 0x3f);
+            bool high = (s[1] & V_BYTE_FIXMASK) == V_BYTE_FIXVAL;
+            fprintf(stderr, "cesu8: Warning: Unpaired %s surrogate U+%04x found at %#06llx! %s\n", high ? "High" : " Low", uni, pos, action);
+        } else if (c->bad[k] + 4 <= c->inlen && (s[1] & QRS_BYTE_FIXMASK) == QRS_BYTE_FIXVAL
+                && (s[2] & QRS_BYTE_FIXMASK) == QRS_BYTE_FIXVAL && (s[3] & QRS_BYTE_FIXMASK) == QRS_BYTE_FIXVAL) {
+            int uni = (s[0] & 0x07) << 18 | (s[1] & 0x3f) << 12 | (s[2] & 0x3f) << 6 | (s[3] & 0x3f);
+            fprintf(stderr, "cesu8: Warning: Invalid 4-byte U+%06x found at %#06llx! %s\n", uni, pos, action);
+        } else {
+            fprintf(stderr, "cesu8: Warning: Invalid UTF-8 sequence found at %#04llx! Left unchanged\n", pos);
+        }
+    }
+}
+
+void *convThread(void *arg)
+{
+    pinThread((int)(intptr_t)arg);
+    for (;;) {
+        pthread_mutex_lock(&tlock);
+        struct chunk *c = &chunks[convseq % nchunks];
+        while (!convdone && c->state != CHUNK_READ) {
+            pthread_cond_wait(&tcond, &tlock);
+            c = &chunks[convseq % nchunks];
+        }
+        if (convdone) {
+            pthread_mutex_unlock(&tlock);
+            return NULL;
+        }
+        c->state = CHUNK_CONVERTING;
+        convseq++;
+        if (c->last) {
+            convdone = true;
+            pthread_cond_broadcast(&tcond);
+        }
+        pthread_mutex_unlock(&tlock);
+
+        convertChecked(c);
+        setChunk(c, CHUNK_DONE);
+    }
+}
+
+void convertThreaded()                              // convert fpi to the output by threads
+{
+    // fail() can't leave the threads running: write errors stop cesu8, read errors are handled at the end
+    bool armed = failarmed;
+    failarmed = false;
+
+    if (nchunks != 2 * threads) {
+        // (re)allocate the chunks for the current number of threads
+        for (int k = 0; k < nchunks; k++) {
+            free(chunks[k].in);
+            free(chunks[k].out);
+            free(chunks[k].bad);
+        }
+        free(chunks);
+        nchunks = 2 * threads;
+        chunks = calloc(nchunks, sizeof(struct chunk));
+        for (int k = 0; chunks && k < nchunks; k++) {
+            chunks[k].in = malloc(TCHUNK);
+            chunks[k].out = malloc(TCHUNK + TCHUNK / 2);
+            if (!chunks[k].in || !chunks[k].out)
+                chunks = NULL;
+        }
+        if (!chunks) {
+            fprintf(stderr, "cesu8: Error: couldn't allocate buffers for %d threads\n", threads);
+            exit(6);
+        }
+    }
+    for (int k = 0; k < nchunks; k++)
+        chunks[k].state = CHUNK_FREE;
+    convseq = 0;
+    convdone = false;
+    convflags = (inverse ? CESU8_U2C : CESU8_C2U) | (fixcode ? CESU8_FIX : 0);
+
+    pthread_t reader, workers[CPU_SETSIZE];
+    int started = 0;
+    if (pthread_create(&reader, NULL, readerThread, NULL) != 0) {
+        fprintf(stderr, "cesu8: Error: couldn't start threads\n");
+        exit(6);
+    }
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, convThread, (void *)(intptr_t)started) != 0)
+            break;
+    }
+    if (started == 0) {
+        fprintf(stderr, "cesu8: Error: couldn't start threads\n");
+        exit(6);
+    }
+
+    pinThread(-1);
+    for (unsigned long long seq = 0; ; seq++) {
+        struct chunk *c = &chunks[seq % nchunks];
+        waitConverted(c);
+        reportChunk(c);
+        writeBytes(c->out, c->outlen);
+        bufpos = c->pos + c->inlen;     // (for the status report only)
+        bool last = c->last;
+        setChunk(c, CHUNK_FREE);
+        if (last)
+            break;
+    }
+
+    pthread_join(reader, NULL);
+    for (int k = 0; k < started; k++)
+        pthread_join(workers[k], NULL);
+    failarmed = armed;
+    if (inerror)
+        fail(inerror);
+}
+
+////////////////////////////////////////////
+// Scan mode (--scan): only check if the file contains anything to convert (surrogate pairs, or
+// 4-byte codes with -i) or malformed sequences, and write the offset of the first one found.
+// The file is mapped to memory and its ranges are scanned by threads (-j, or as many as CPUs
+// available) in blocks; the first hit stops all the threads. A sequence belongs to the range it
+// starts in: the scan of a range goes on up to 5 bytes past its end, and the scan of the next
+// one starts at the start of the sequence the range boundary is in.
+
+#define SCAN_BLOCK          (1024 * 1024)   // bytes scanned between checks for a hit of another thread
+#define SCAN_OVERLAP        5               // a sequence may go on 5 bytes past its block
+
+bool scan = false;                  // --scan
+bool scanfound = false;             // a hit in any of the files (exit code 8)
+int scanflags;                      // libcesu8 flags of the scan
+const unsigned char *smap;          // the mapped file
+size_t ssize;
+int sthreads;                       // threads scanning ssize / sthreads bytes each
+int scanstop;                       // a thread found a hit (atomic)
+unsigned long long scanhit;         // the lowest hit found (atomic; ULLONG_MAX: none)
+
+size_t syncBack(const unsigned char *p, size_t pos, size_t size)   // start of the sequence pos is in
+{
+    for (int i = 0; i < 3 && pos > 0 && (p[pos] & QRS_BYTE_FIXMASK) == QRS_BYTE_FIXVAL; i++)
+        pos--;
+    // the low surrogate of a pair:
+    if (pos >= 3 && pos + 1 < size && p[pos] == X_BYTE && (p[pos + 1] & Y_BYTE_FIXMASK) == Y_BYTE_FIXVAL
+            && p[pos - 3] == U_BYTE && (p[pos - 2] & V_BYTE_FIXMASK) == V_BYTE_FIXVAL)
+        pos -= 3;
+    return pos;
+}
+
+void scanHit(unsigned long long pos)
+{
+    unsigned long long old = __atomic_load_n(&scanhit, __ATOMIC_RELAXED);
+    while (pos < old && !__atomic_compare_exchange_n(&scanhit, &old, pos, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    __atomic_store_n(&scanstop, 1, __ATOMIC_RELEASE);
+}
+
+void *scanThread(void *arg)
+{
+    int worker = (int)(intptr_t)arg;
+    size_t start = ssize / sthreads * worker;
+    size_t end = (worker == sthreads - 1) ? ssize : ssize / sthreads * (worker + 1);
+
+    pinThread(worker);
+    for (size_t b = start; b < end && !__atomic_load_n(&scanstop, __ATOMIC_ACQUIRE); b += SCAN_BLOCK) {
+        size_t e = (end - b > SCAN_BLOCK) ? b + SCAN_BLOCK : end;
+        size_t from = syncBack(smap, b, ssize);
+        size_t to = (ssize - e > SCAN_OVERLAP) ? e + SCAN_OVERLAP : ssize;
+        size_t pos = from + cesu8_find(scanflags, smap + from, to - from);
+        if (pos < e) {
+            // (a hit after e may be a sequence cut at to: it's the next block's)
+            scanHit(pos);
+            break;
+        }
+    }
+    return NULL;
+}
+
+bool scanMapped()                                   // scan fpi by threads; false if it can't be mapped
+{
+    struct stat st;
+    int fd = fileno(fpi);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return false;
+    ssize = (size_t)st.st_size;
+    smap = mmap(NULL, ssize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (smap == MAP_FAILED)
+        return false;
+    madvise((void *)smap, ssize, MADV_SEQUENTIAL);
+
+    int n = threads ? threads : effectiveCpus();
+    if ((size_t)n > ssize / SCAN_BLOCK + 1)
+        n = (int)(ssize / SCAN_BLOCK) + 1;      // no need for more threads than blocks
+    sthreads = n;
+    pthread_t *tids = malloc(sizeof(pthread_t) * n);
+    if (!tids) {
+        fprintf(stderr, "cesu8: Error: couldn't allocate memory for threads\n");
+        exit(6);
+    }
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&tids[i], NULL, scanThread, (void *)(intptr_t)i) != 0) {
+            fprintf(stderr, "cesu8: Error: couldn't start threads\n");
+            exit(6);
+        }
+    }
+    for (int i = 0; i < n; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    munmap((void *)smap, ssize);
+    return true;
+}
+
+void scanFile()
+{
+    scanflags = CESU8_NORMALIZE | CESU8_FIX | (inverse ? CESU8_U2C : 0);
+    scanstop = 0;
+    scanhit = ULLONG_MAX;
+    if (nconcat > 0 || !scanMapped()) {
+        // not a regular file (e.g. a pipe) or parts: scan it sequentially
+        while (readFile()) {
+            bool last = (blen < bsize);
+            size_t pos = cesu8_find(scanflags, buff, blen);
+            if (pos < (size_t)blen && (last || pos + SCAN_OVERLAP < (size_t)blen)) {
+                scanhit = bufpos + pos;
+                break;
+            }
+            // the last bytes are scanned again with the next chunk:
+            rlen = last ? blen : (int)syncBack(buff, blen - SCAN_OVERLAP, blen);
+        }
+    }
+    if (scanhit != ULLONG_MAX) {
+        fprintf(fpo, "%s: %#06llx\n", inputfile, scanhit);
+        scanfound = true;
+    } else {
+        fprintf(fpo, "%s: clean\n", inputfile);
+    }
+}
+
+////////////////////////////////////////////
+// Triage mode (--triage): only the lines to be modified by the conversion are written, converted,
+// prefixed by the file name, the line number and the offset of the line, like
+//   file.txt:1234:0x1e2a4:converted text
+// i.e. lines with surrogate pairs (or 4-byte codes with -i) and lines with invalid sequences
+// (unpaired surrogates, invalid 4-byte codes, stray bytes). The buffers are scanned by the same
+// libcesu8 scanner as at --scan: clean regions are skipped, only their newlines are counted, and
+// the lines of the hits are widened to their boundaries in buff. buff is grown for a line that
+// doesn't fit in it.
+
+bool triage = false;                // --triage
+
+void growBuff()                                     // double the size of buff, keeping its contents
+{
+    unsigned char *nb = realloc(buff, 2 * (size_t)bsize);
+    if (nb)
+        buff = nb;
+    unsigned char *no = nb ? realloc(obuff, 3 * (size_t)bsize) : NULL;
+    if (no)
+        obuff = no;
+    if (!nb || !no || bsize > INT_MAX / 2) {
+        fprintf(stderr, "cesu8: Error: couldn't allocate %lld byte buffers\n", 2LL * bsize);
+        exit(6);
+    }
+    bsize *= 2;
+}
+
+void triageFile()
+{
+    int flags = (inverse ? CESU8_U2C : CESU8_C2U);
+    int findflags = CESU8_NORMALIZE | CESU8_FIX | flags;
+    unsigned long long lineno = 1;      // line number of the line at rlen (rlen is always at a line start)
+    int scanned = 0;                    // bytes after rlen found clean (without newlines) already
+
+    while (readFile()) {
+        bool last = (blen < bsize);
+        // a hit in the last bytes may be a sequence cut by the end of buff: it's checked again
+        int limit = (last || blen <= SCAN_OVERLAP) ? blen : blen - SCAN_OVERLAP;
+        int i = rlen + scanned;
+        while (i < blen) {
+            int hit = i + (int)cesu8_find(findflags, buff + i, blen - i);
+            int end = (hit < limit) ? hit : limit;
+            // count the lines up to the hit:
+            const unsigned char *nl;
+            while (i < end && (nl = memchr(buff + i, '\n', end - i))) {
+                i = (int)(nl - buff) + 1;
+                rlen = i;
+                lineno++;
+            }
+            if (hit >= limit) {
+                // (the scan goes on at the start of the sequence limit is in)
+                i = last ? blen : (int)syncBack(buff, limit, blen);
+                if (i < rlen)
+                    i = rlen;
+                break;
+            }
+            nl = memchr(buff + hit, '\n', blen - hit);
+            if (!nl && !last) {
+                i = hit;    // the line goes on in the next buffer
+                break;
+            }
+            int lend = nl ? (int)(nl - buff) + 1 : blen;
+
+            size_t len = lend - rlen, outlen;
+            const unsigned char *l = buff + rlen;
+            const unsigned char *conv = cesu8_convert_cow(flags | (fixcode ? CESU8_FIX : 0), l, len, &outlen);
+            if (!conv) {
+                fprintf(stderr, "cesu8: Error: couldn't allocate %zu bytes for a line\n", len);
+                exit(6);
+            }
+            fprintf(fpo, "%s:%llu:%#06llx:", inputfile, lineno, bufpos + rlen);
+            writeBytes(conv, outlen);
+            if (conv[outlen - 1] != '\n')
+                writeBytes((const unsigned char *)"\n", 1);
+            if (conv != l)
+                free((void *)conv);
+            rlen = i = lend;
+            lineno++;
+        }
+        if (last)
+            rlen = blen;
+        scanned = i - rlen;
+        if (!last && rlen == 0 && blen == bsize)
+            growBuff();     // the line is longer than buff
+    }
+}
+
+////////////////////////////////////////////
+// Watch mode (--watch <dir> <targetdir>): convert files as they arrive in a drop folder.
+//
+// Completed files (closed after writing, or moved to dir) are queued and converted by a pool of
+// worker threads. A converted file is written to a hidden temporary file in targetdir first, then
+// renamed to its final name, so that it's published atomically. The queue is bounded: a burst
+// of new files is held back in the kernel's inotify queue instead of overwhelming the host.
+// (The global buffers above belong to the main thread, workers convert by libcesu8.)
+
+#define WATCH_QUEUE         64      // queued file names
+#define WATCH_BSIZE         (BSIZE * 16)
+
+const char *watchdir;               // drop folder
+const char *targetdir;              // converted files are published here
+int watchflags;                     // libcesu8 flags of the conversion
+mode_t watchmode;                   // mode of the published files (according to umask)
+
+char *wqueue[WATCH_QUEUE];          // file names to convert (ring buffer)
+int wqhead;                         // next name to take
+int wqcount;                        // names in the queue
+pthread_mutex_t wqlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wqnotempty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t wqnotfull = PTHREAD_COND_INITIALIZER;
+
+void enqueueFile(const char *name)                  // blocks while the queue is full
+{
+    char *n = strdup(name);
+    if (!n)
+        return;
+    pthread_mutex_lock(&wqlock);
+    while (wqcount == WATCH_QUEUE)
+        pthread_cond_wait(&wqnotfull, &wqlock);
+    wqueue[(wqhead + wqcount++) % WATCH_QUEUE] = n;
+    pthread_cond_signal(&wqnotempty);
+    pthread_mutex_unlock(&wqlock);
+}
+
+char *dequeueFile()                                 // blocks while the queue is empty
+{
+    pthread_mutex_lock(&wqlock);
+    while (wqcount == 0)
+        pthread_cond_wait(&wqnotempty, &wqlock);
+    char *n = wqueue[wqhead];
+    wqhead = (wqhead + 1) % WATCH_QUEUE;
+    wqcount--;
+    pthread_cond_signal(&wqnotfull);
+    pthread_mutex_unlock(&wqlock);
+    return n;
+}
+
+bool convertWatched(const char *name)               // convert watchdir/name to targetdir/name
+{
+    char src[PATH_MAX], dst[PATH_MAX], tmp[PATH_MAX];
+    if (snprintf(src, sizeof(src), "%s/%s", watchdir, name) >= (int)sizeof(src)
+     || snprintf(dst, sizeof(dst), "%s/%s", targetdir, name) >= (int)sizeof(dst)
+     || snprintf(tmp, sizeof(tmp), "%s/.%s.XXXXXX", targetdir, name) >= (int)sizeof(tmp))
+        return false;
+
+    FILE *fp = fopen(src, "rb");
+    if (!fp)
+        return false;
+    FILE *fpc = cesu8_fopen(fp, watchflags);
+    if (!fpc) {
+        fclose(fp);
+        return false;
+    }
+    int fd = mkstemp(tmp);
+    FILE *out = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+    if (!out) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        fclose(fpc);
+        return false;
+    }
+
+    static _Thread_local unsigned char wbuff[WATCH_BSIZE];
+    size_t n;
+    while ((n = fread(wbuff, 1, sizeof(wbuff), fpc)) > 0) {
+        if (fwrite(wbuff, 1, n, out) < n)
+            break;
+        __atomic_fetch_add(&nwritten, n, __ATOMIC_RELAXED);     // (for the status report only)
+    }
+    long inlen = ftell(fp);
+    if (inlen > 0)
+        __atomic_fetch_add(&nread, (unsigned long long)inlen, __ATOMIC_RELAXED);
+    bool ok = !ferror(fpc) && !ferror(out);
+    ok = (fclose(fpc) == 0) && ok;
+    ok = (fchmod(fd, watchmode) == 0) && ok;
+    ok = (fclose(out) == 0) && ok;
+    if (ok)
+        ok = (rename(tmp, dst) == 0);       // publish
+    if (!ok)
+        unlink(tmp);
+    return ok;
+}
+
+void *watchWorker(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        char *name = dequeueFile();
+        if (!convertWatched(name)) {
+            if (!silentio)
+                fprintf(stderr, "cesu8: Error: couldn't convert %s/%s to %s\n", watchdir, name, targetdir);
+        } else if (verbose)
+            fprintf(stderr, "Converted %s/%s to %s\n", watchdir, name, targetdir);
+        free(name);
+    }
+    return NULL;
+}
+
+void runWatch()                                     // never returns
+{
+    struct stat ws, ts;
+    if (stat(watchdir, &ws) != 0 || stat(targetdir, &ts) != 0 || !S_ISDIR(ws.st_mode) || !S_ISDIR(ts.st_mode)) {
+        if (!silentio)
+            fprintf(stderr, "cesu8: Error: couldn't watch %s: both %s and %s must be directories\n", watchdir, watchdir, targetdir);
+        exit(1);
+    }
+    if (ws.st_dev == ts.st_dev && ws.st_ino == ts.st_ino) {
+        if (!silentio)
+            fprintf(stderr, "cesu8: Error: couldn't watch %s: converted files must go to another directory\n", watchdir);
+        exit(1);
+    }
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, watchdir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+        if (!silentio)
+            fprintf(stderr, "cesu8: Error: couldn't watch %s\n", watchdir);
+        exit(1);
+    }
+
+    watchflags = (inverse ? CESU8_U2C : CESU8_C2U) | (fixcode ? CESU8_FIX : 0);
+    watchmode = umask(0);
+    umask(watchmode);
+    watchmode = 0666 & ~watchmode;
+
+    int workers = effectiveCpus();
+    for (int w = 0; w < workers; w++) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, watchWorker, NULL) != 0) {
+            if (w > 0)
+                break;      // go on with fewer workers
+            if (!silentio)
+                fprintf(stderr, "cesu8: Error: couldn't start worker threads\n");
+            exit(1);
+        }
+        pthread_detach(th);
+    }
+
+    char events[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        stage = STAGE_READ;
+        ssize_t len = read(fd, events, sizeof(events));
+        stage = STAGE_IDLE;
+        if (statusreq)
+            writeStatus();
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            if (!silentio)
+                fprintf(stderr, "cesu8: Error: couldn't read events of %s\n", watchdir);
+            exit(3);
+        }
+        for (char *p = events; p < events + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                if (!silent)
+                    fprintf(stderr, "cesu8: Warning: too many new files in %s, some of them are not converted!\n", watchdir);
+            } else if (ev->len && ev->name[0] != '.' && !(ev->mask & IN_ISDIR)) {
+                enqueueFile(ev->name);      // (hidden files are skipped: they are usually temporary ones)
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+////////////////////////////////////////////
+
+////////////////////////////////////////////
+// Output handoff (--memfd <socket>): the output of each input file is written to a memfd instead of
+// fpo; when the file is done, the memfd is sealed (it can't be modified any more) and its descriptor
+// is sent over a Unix domain socket (SCM_RIGHTS), with the name of the input file and a newline as
+// the message. The consumer maps the memfd: the converted text is not copied through a pipe.
+// The socket is connected to the given path, or it's an inherited descriptor: fd:<n>.
+// The protocol of the consumer is described in README.md.
+
+int memfdsock = -1;                 // --memfd   socket the memfds are sent over
+FILE *fpmain;                       // fpo (the output of -o) while writing to a memfd
+const char *outmain;                // outputfile of fpmain
+
+void openHandoff(const char *sock)                  // connect to the consumer
+{
+    if (strncmp(sock, "fd:", 3) == 0) {
+        char *end;
+        long fd = strtol(sock + 3, &end, 10);
+        if (end == sock + 3 || *end || fd < 0 || fd > INT_MAX) {
+            fprintf(stderr, "cesu8: Error: invalid socket descriptor: %s (fd:<n>)\n", sock);
+            exit(6);
+        }
+        memfdsock = (int)fd;
+        int type;
+        socklen_t tlen = sizeof(type);
+        if (getsockopt(memfdsock, SOL_SOCKET, SO_TYPE, &type, &tlen) != 0) {
+            if (!silentio)
+                fprintf(stderr, "cesu8: Error: %s is not a socket\n", sock);
+            exit(4);
+        }
+        return;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(sock) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "cesu8: Error: socket path too long: %s\n", sock);
+        exit(6);
+    }
+    strcpy(addr.sun_path, sock);
+    memfdsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (memfdsock < 0 || connect(memfdsock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        if (!silentio)
+            fprintf(stderr, "cesu8: Error: couldn't connect to %s\n", sock);
+        exit(4);
+    }
+}
+
+void openMemfd()                                    // direct the output of inputfile to a new memfd
+{
+    int fd = memfd_create("cesu8", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    FILE *fp = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+    if (!fp) {
+        if (!silentio)
+            fprintf(stderr, "cesu8: Error: couldn't create a memfd for %s\n", inputfile);
+        exit(4);
+    }
+    fpmain = fpo;
+    outmain = outputfile;
+    fpo = fp;
+    outputfile = "memfd";
+}
+
+void closeMemfd(bool send)                          // seal and send the memfd (or just drop it)
+{
+    int fd = fileno(fpo);
+    if (send) {
+        if (fflush(fpo) != 0) {
+            if (!silentio)
+                fprintf(stderr, "cesu8: Error: couldn't write memfd while processing %s\n", inputfile);
+            exit(2);
+        }
+        if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+            if (!silentio)
+                fprintf(stderr, "cesu8: Error: couldn't seal the memfd of %s\n", inputfile);
+            exit(5);
+        }
+
+        // the name of the input file is the message, the memfd goes with it:
+        struct iovec iov[2] = { { (void *)inputfile, strlen(inputfile) }, { "\n", 1 } };
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } ctl;
+        memset(&ctl, 0, sizeof(ctl));
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2, .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf) };
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+        ssize_t sent;
+        while ((sent = sendmsg(memfdsock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+            ;
+        if (sent < 0) {
+            if (!silentio)
+                fprintf(stderr, "cesu8: Error: couldn't send the memfd of %s\n", inputfile);
+            exit(2);
+        }
+        // (a short send of the name is not retried: the memfd went with its first byte)
+    }
+    fclose(fpo);
+    fpo = fpmain;
+    outputfile = outmain;
+}
+
+////////////////////////////////////////////
+// Processing of an input file; in batch mode (-k) the failed ones are counted and listed in the
+// manifest (--failed <file>), which can be given to --files-from to process them again. A --concat
+// input is listed with all its parts on one line, separated by tabs, and it's read back as such.
+
+int nfiles;                         // input files processed
+int nfailed;                        // input files failed (-k)
+FILE *fpf;                          // --failed   manifest of the failed input files
+unsigned long long filesubst;       // nsubst before the current file
+
+void convertFile(const char *file)
+{
+    inputfile = file;
+    nfiles++;
+    char **parts = concatparts;         // (for the manifest)
+    int nparts = nconcat;
+    bool threaded = !scan && !triage && threads;      // (the options -j can't be used with are rejected by main())
+    fpi = NULL;
+    if (keepgoing) {
+        if (setjmp(failjmp) != 0) {
+            failarmed = false;
+            if (pooled)
+                stopPool();
+            if (fpi)
+                closeFile();
+            if (memfdsock >= 0)
+                closeMemfd(false);
+            nfailed++;
+            if (fpf) {
+                fprintf(fpf, "%s", file);
+                for (int k = 0; k < nparts; k++)
+                    fprintf(fpf, "\t%s", parts[k]);
+                fprintf(fpf, "\n");
+                fflush(fpf);
+            }
+            return;
+        }
+        failarmed = true;
+    }
+
+    if (memfdsock >= 0)
+        openMemfd();
+    openFile();
+    if (scan) {
+        scanFile();
+    } else if (triage) {
+        triageFile();
+    } else if (profile) {
+        profileStart();
+        while (readFile())
+            profileBuff();
+        profileEnd();
+    } else if (threaded) {
+        convertThreaded();
+    } else {
+        if (maxmemory)
+            startPool();
+        while (readFile()) {
+            if (sbcs)
+                convertSbcsBuff();      // Latin-1 or Windows-1252 to UTF-8
+            else if (normalize)
+                normalizeBuff();        // UTF-8 and CESU-8 to either one
+            else if (inverse)
+                convertUtfBuff();       // UTF-8 to CESU-8
+            else
+                convertCesuBuff();      // CESU-8 to UTF-8
+        }
+        if (pooled)
+            stopPool();
+        if (outerror)
+            fail(outerror);     // (the rest of the output couldn't be written)
+    }
+    failarmed = false;
+    if (nmaps && !silent)
+        fprintf(stderr, "cesu8: %llu codes substituted in %s\n", nsubst - filesubst, inputfile);
+    filesubst = nsubst;
+    closeFile();
+    if (fingerprint)
+        writeFingerprint();
+    if (memfdsock >= 0)
+        closeMemfd(true);
+}
+
+// Process the files listed in list (one per line; '-': stdin); a line of tab separated names is the
+// parts of a --concat input
+void convertFilesFrom(const char *list)
+{
+    FILE *fp = (strcmp(list, "-") == 0) ? stdin : fopen(list, "r");
+    if (!fp) {
+        if (!silentio)
+            fprintf(stderr, "cesu8: Error: couldn't open %s\n", list);
+        exit(1);
+    }
+    char *line = NULL;
+    size_t lsize = 0;
+    ssize_t len;
+    while ((len = getline(&line, &lsize, fp)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = 0;
+        if (len == 0)
+            continue;
+        char *file = strdup(line);      // (inputfile is kept for the reports)
+        int n = 1;
+        for (char *t = file; t && (t = strchr(t, '\t')); t++)
+            n++;
+        char **parts = file ? malloc(n * sizeof(char *)) : NULL;
+        if (!parts) {
+            fprintf(stderr, "cesu8: Error: out of memory\n");
+            exit(6);
+        }
+        parts[0] = file;
+        for (int k = 1; k < n; k++) {
+            parts[k] = strchr(parts[k - 1], '\t');
+            *parts[k]++ = 0;
+        }
+        if (triage && n > 1) {
+            fprintf(stderr, "cesu8: Error: --concat input (%s) can't be used with --triage\n", file);
+            exit(6);
+        }
+        concatparts = parts + 1;
+        nconcat = n - 1;
+        convertFile(file);
+        nconcat = 0;
+        free(parts);
+    }
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+}
+
+int main(int argc, char **argv)
 {
     int i;
 
     setlocale(LC_ALL, "");  // for printf'ing Unicode characters: %lc
     fpo = stdout;
+#ifdef BMI2_KERNELS
+    usebmi2 = detectBmi2();
+#endif
+    mainthread = pthread_self();
+    allocBuffers(BSIZE);
+    startStatus();
 
     for (i=1; i<argc; i++) {
         if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--u2c") == 0) {
@@ -473,23 +2785,155 @@ int main(int argc, char **argv)
         } else if (strcmp(argv[i], "-S") == 0) {
             silent = true;
             silentio = true;
+        } else if (strcmp(argv[i], "-H") == 0 || strcmp(argv[i], "--fingerprint") == 0) {
+            fingerprint = true;
+        } else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--buffer-size") == 0) {
+            if (++i < argc)
+                allocBuffers((int)parseSize(argv[i], 64, MAXSIZE));
+        } else if (strcmp(argv[i], "--max-memory") == 0) {
+            if (++i < argc)
+                maxmemory = parseSize(argv[i], 3 * BSIZE, MAXMEMORY);
+        } else if (strcmp(argv[i], "--normalize") == 0) {
+            exclusive(nmaps, "--normalize", "--map");
+            exclusive(threads, "--normalize", "-j");
+            if (++i < argc) {
+                if (strcmp(argv[i], "utf8") == 0)
+                    normalize = CESU8_NORMALIZE;
+                else if (strcmp(argv[i], "cesu8") == 0)
+                    normalize = CESU8_NORMALIZE | CESU8_U2C;
+                else {
+                    fprintf(stderr, "cesu8: Error: invalid target encoding: %s (utf8 or cesu8)\n", argv[i]);
+                    exit(6);
+                }
+            }
+        } else if (strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "--keep-going") == 0) {
+            keepgoing = true;
+        } else if (strcmp(argv[i], "--failed") == 0) {
+            if (++i < argc) {
+                if (fpf)
+                    fclose(fpf);
+                fpf = fopen(argv[i], "w");
+                if (!fpf) {
+                    if (!silentio)
+                        fprintf(stderr, "cesu8: Error: couldn't open %s\n", argv[i]);
+                    exit(4);
+                }
+                keepgoing = true;
+            }
+        } else if (strcmp(argv[i], "--files-from") == 0) {
+            if (++i < argc)
+                convertFilesFrom(argv[i]);
+        } else if (strcmp(argv[i], "--memfd") == 0) {
+            if (++i < argc)
+                openHandoff(argv[i]);
+        } else if (strcmp(argv[i], "--concat") == 0) {
+            exclusive(triage, "--concat", "--triage");
+            concat = true;
+        } else if (strcmp(argv[i], "--map") == 0) {
+            exclusive(normalize, "--map", "--normalize");
+            exclusive(threads, "--map", "-j");
+            if (++i < argc)
+                loadMap(argv[i]);
+        } else if (strcmp(argv[i], "--from") == 0) {
+            exclusive(threads, "--from", "-j");
+            if (++i < argc) {
+                if (strcmp(argv[i], "latin1") == 0)
+                    setCharset(false);
+                else if (strcmp(argv[i], "cp1252") == 0)
+                    setCharset(true);
+                else {
+                    fprintf(stderr, "cesu8: Error: invalid input charset: %s (latin1 or cp1252)\n", argv[i]);
+                    exit(6);
+                }
+            }
+        } else if (strcmp(argv[i], "--replace") == 0) {
+            replace = true;
+        } else if (strcmp(argv[i], "--strict") == 0) {
+            strict = true;
+        } else if (strcmp(argv[i], "--scan") == 0) {
+            scan = true;
+        } else if (strcmp(argv[i], "--triage") == 0) {
+            exclusive(concat, "--triage", "--concat");
+            triage = true;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            exclusive(threads, "--profile", "-j");
+            if (++i < argc) {
+                if (strcmp(argv[i], "csv") == 0)
+                    profile = PROFILE_CSV;
+                else if (strcmp(argv[i], "json") == 0)
+                    profile = PROFILE_JSON;
+                else {
+                    fprintf(stderr, "cesu8: Error: invalid profile format: %s (csv or json)\n", argv[i]);
+                    exit(6);
+                }
+            }
+        } else if (strcmp(argv[i], "--window") == 0) {
+            if (++i < argc)
+                pwindow = (int)parseSize(argv[i], 64, MAXSIZE);
+        } else if (strcmp(argv[i], "--latency") == 0) {
+            exclusive(threads, "--latency", "-j");
+            startLatency();
+        } else if (strcmp(argv[i], "--block-size") == 0) {
+            if (++i < argc)
+                blocksize = (int)parseSize(argv[i], 64, MAXSIZE);
+        } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0) {
+            exclusive(normalize, "-j", "--normalize");
+            exclusive(nmaps, "-j", "--map");
+            exclusive(sbcs, "-j", "--from");
+            exclusive(profile, "-j", "--profile");
+            exclusive(latency, "-j", "--latency");
+            if (++i < argc) {
+                threads = atoi(argv[i]);
+                if (threads <= 0)
+                    threads = effectiveCpus();
+                if (threads > CPU_SETSIZE)
+                    threads = CPU_SETSIZE;
+            }
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            if (++i < argc)
+                parseCpus(argv[i]);
+        } else if (strcmp(argv[i], "--coprocess") == 0) {
+            inputfile = "-";
+            runCoprocess();
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            if (i + 2 < argc) {
+                watchdir = argv[++i];
+                targetdir = argv[++i];
+                runWatch();
+            }
         } else if (strcmp(argv[i], "-o") == 0) {
             if (++i < argc)
                 openOutput(argv[i]);
         } else {
             // this is the file to convert:
-            inputfile = argv[i];
-            openFile();
-            while (readFile()) {
-                if (inverse)
-                    convertUtfBuff();       // UTF-8 to CESU-8
-                else
-                    convertCesuBuff();      // CESU-8 to UTF-8
-            }
-            closeFile();
+            if (concat) {
+                // the file arguments up to the next option are its parts
+                concatparts = argv + i + 1;
+                for (nconcat = 0; i + 1 + nconcat < argc; nconcat++) {
+                    const char *a = argv[i + 1 + nconcat];
+                    if (a[0] == '-' && a[1])
+                        break;
+                }
+                int parts = nconcat;
+                convertFile(argv[i]);
+                nconcat = 0;
+                i += parts;
+            } else
+                convertFile(argv[i]);
         }
     }
     openOutput("-");    // close previous output...
+    if (latency)
+        writeLatency();
+    if (fpf)
+        fclose(fpf);
+    if (nfailed) {
+        if (!silentio)
+            fprintf(stderr, "cesu8: %d of %d files failed\n", nfailed, nfiles);
+        return 9;
+    }
+    if (scanfound)
+        return 8;
 
     if (!inputfile) {
         fprintf(stderr,
@@ -505,7 +2949,77 @@ int main(int argc, char **argv)
                 "  -v           Verbose mode: report converted codes\n"
                 "  -s           Silent mode: don't report encoding warnings\n"
                 "  -S           Silent mode: don't report file I/O errors and encoding warnings\n"
+                "  -H  --fingerprint\n"
+                "               Don't write the converted text, but its 64-bit hash (xxHash)\n"
+                "               CESU-8 and UTF-8 files of the same text have the same hash\n"
+                "      --normalize <utf8|cesu8>\n"
+                "               Convert UTF-8 and CESU-8 (even mixed) to the given encoding in one\n"
+                "               pass; fix malformed sequences (unpaired surrogates, invalid codes,\n"
+                "               stray bytes) by -f, --replace or --strict (not with -j)\n"
+                "  -k  --keep-going\n"
+                "               Don't stop at an error of an input file, go on with the next one;\n"
+                "               exit code 9 if any of them failed (write errors of -j still\n"
+                "               stop cesu8)\n"
+                "      --failed <file>\n"
+                "               Write the names of the failed input files to <file> (implies -k);\n"
+                "               the parts of a --concat input on one line, separated by tabs\n"
+                "      --files-from <file>\n"
+                "               Process the files listed in <file> (one per line), e.g. --failed list;\n"
+                "               a line of tab separated names is the parts of one --concat input\n"
+                "      --memfd <socket>\n"
+                "               Write the output of each file to a sealed memfd and send it over\n"
+                "               the Unix socket <socket> (path, or fd:<n> for an inherited one)\n"
+                "      --concat\n"
+                "               Convert the files up to the next option as parts of one input\n"
+                "               (e.g. made by split -b): sequences may be split between them\n"
+                "               (not with --triage)\n"
+                "      --map <file>\n"
+                "               Substitute the code points listed in <file> at conversion; lines:\n"
+                "               <code point> <replacement>, e.g. U+1F600 :-) (not with -j\n"
+                "               or --normalize)\n"
+                "      --from <latin1|cp1252>\n"
+                "               Input is Latin-1 or Windows-1252: convert it to UTF-8, that is\n"
+                "               CESU-8, too (no 4-byte codes result) (not with -j)\n"
+                "      --replace\n"
+                "               Convert malformed sequences to U+FFFD (at --normalize)\n"
+                "      --strict\n"
+                "               Stop at the first malformed sequence, exit code 7 (at --normalize)\n"
+                "      --scan\n"
+                "               Don't convert, only check the file(s) by threads (see -j): write\n"
+                "               the offset of a sequence to convert or a malformed one, or 'clean';\n"
+                "               exit code 8 if any is found\n"
+                "      --triage\n"
+                "               Write only the lines modified by the conversion or having invalid\n"
+                "               sequences (converted), prefixed by <file>:<line number>:<offset>:\n"
+                "      --profile <csv|json>\n"
+                "               Don't convert, but write a profile: counts of pairs, non-surrogate\n"
+                "               0xED codes, unpaired surrogates and 4-byte codes per window (not with -j)\n"
+                "      --window <size>\n"
+                "               Window size of the profile (default: 1M)\n"
                 "  -o <file>    Write output to <file>, not stdout\n"
+                "  -b  --buffer-size <size>\n"
+                "               Size of the I/O buffer (default: 4k; k, M and G suffixes accepted)\n"
+                "      --max-memory <size>\n"
+                "               Read ahead and write behind using buffers of <size> bytes in total\n"
+                "      --latency\n"
+                "               Report the read-to-write latency of the input chunks (histogram)\n"
+                "               at exit and on SIGUSR2 (not with -j)\n"
+                "               (SIGUSR1, in any mode: report the status to stderr: position,\n"
+                "               byte and code counts, throughput)\n"
+                "      --block-size <size>\n"
+                "               Process large buffers in cache sized blocks (default: 16k)\n"
+                "  -j  --threads <n>\n"
+                "               Convert by <n> threads (0: as many as CPUs available, according to\n"
+                "               CPU affinity and cgroup CPU quota); codes are not reported one by one\n"
+                "      --pin <cpus>\n"
+                "               Pin threads to CPUs, e.g. 0,2-5: the first one is for the I/O\n"
+                "               threads, the others for the conversion threads\n"
+                "      --watch <dir> <targetdir>\n"
+                "               Convert files as they are written (or moved) to <dir>,\n"
+                "               write the converted files to <targetdir>; runs until killed\n"
+                "      --coprocess\n"
+                "               Convert framed requests read from stdin, write framed responses:\n"
+                "               Frame: 1 byte flags (1: -i, 2: -f), 4 byte length (big endian), text\n"
                 "Note: An option affects processing of file(s) that follow it\n"
                 "Note: Conversion is done without checking the file's encoding!\n"
                 "If the file is already UTF-8 (or CESU-8 in case of -i), no codes are modified.\n"
@@ -0,0 +1,79 @@
+//
+// This project is licensed under the terms of the MIT license.
+//
+
+/******************************* libcesu8: buffer conversion API ***********************************
+
+The conversion engine of the cesu8 tool works on its own global buffers and FILE pointers. This
+library carries the same conversion kernels, re-entrant and working on caller supplied buffers,
+so that other programs (e.g. the glibc gconv module, see cesu8-gconv.c) can convert in-process.
+
+See cesu8.c for the description of the CESU-8 and UTF-8 byte sequences.
+**************************************************************************************************/
+
+#ifndef CESU8_H
+#define CESU8_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// The conversion flags (CESU8_C2U, CESU8_U2C, CESU8_FIX, CESU8_STRICT, CESU8_LAST, CESU8_NORMALIZE,
+// CESU8_REPLACE) and the status codes of cesu8_convert() (CESU8_OK, CESU8_FULL, CESU8_INCOMPLETE,
+// CESU8_INVALID) are defined in cesu8-single.h, with the declarations of the functions below:
+#ifndef CESU8_DEF
+#define CESU8_DEF                   // (extern: the functions of libcesu8)
+#endif
+#include "cesu8-single.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Convert *inlen bytes at in to at most *outlen bytes at out.
+// On return *inlen and *outlen hold the number of bytes consumed and produced.
+// Sequences are never split: conversion stops before a sequence that doesn't fit to out.
+// At CESU-8 to UTF-8 conversion out may be the same as in (output is never longer than input);
+// at UTF-8 to CESU-8 conversion output can be 1.5 times longer than input.
+// With CESU8_NORMALIZE the input may be any mix of UTF-8 and CESU-8: surrogate pairs and 4-byte
+// codes are both converted to the target encoding, and all the malformations (unpaired surrogates,
+// invalid or overlong codes, stray and truncated bytes) are handled by one policy: left unchanged
+// (default), '?' (CESU8_FIX), U+FFFD (CESU8_REPLACE; output may be 3 times longer than input) or
+// CESU8_INVALID (CESU8_STRICT).
+int cesu8_convert(int flags, const unsigned char *in, size_t *inlen, unsigned char *out, size_t *outlen);
+
+// Convert len bytes at in (flags: CESU8_U2C, CESU8_FIX, CESU8_NORMALIZE, CESU8_REPLACE). The input
+// is scanned first: if nothing is to be converted, in itself is returned (*outlen == len).
+// Otherwise a malloc'ed buffer holding the converted text (*outlen bytes) is returned, to be freed
+// by the caller; NULL if out of memory.
+const unsigned char *cesu8_convert_cow(int flags, const unsigned char *in, size_t len, size_t *outlen);
+
+// Return the offset of the first sequence cesu8_convert_cow() would modify (same flags), or len if
+// there is none. E.g. CESU8_NORMALIZE | CESU8_FIX finds surrogate pairs and malformed sequences.
+// The input is taken as complete: a sequence cut at the end of it is reported as malformed.
+size_t cesu8_find(int flags, const unsigned char *in, size_t len);
+
+// Open a read-only stream returning the converted text of fp (flags: CESU8_U2C, CESU8_FIX), so that
+// fread(), fgets() etc. read UTF-8 (or CESU-8) on the fly. Closing the stream closes fp, too.
+// Returns NULL on failure (fp is left open then). Uses fopencookie(), i.e. glibc or musl is needed.
+FILE *cesu8_fopen(FILE *fp, int flags);
+// Same as cesu8_fopen(fdopen(fd, "rb"), flags), but fd is closed if the stream can't be created.
+FILE *cesu8_fdopen(int fd, int flags);
+
+// Line iterator over the converted text of fp (flags: CESU8_U2C, CESU8_FIX, CESU8_STRICT).
+// Lines without anything to convert are returned in place, in the iterator's input buffer; a line
+// is copied only if it spans the end of that buffer. Returns NULL if out of memory.
+struct cesu8_lines *cesu8_lines_open(FILE *fp, int flags);
+// Get the next line (with its newline, if any): *line is valid until the next call.
+// Returns 1 if a line is returned, 0 at the end of input, -1 on error (errno is set; EILSEQ:
+// an invalid code found with CESU8_STRICT, the line is skipped then).
+int cesu8_lines_next(struct cesu8_lines *ln, const unsigned char **line, size_t *len);
+// Free the iterator and close fp; returns the result of fclose().
+int cesu8_lines_close(struct cesu8_lines *ln);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CESU8_H
+
+// vim: tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
@@ -0,0 +1,308 @@
+//
+// This project is licensed under the terms of the MIT license.
+//
+
+/******************************* libcesu8: buffer conversion ***************************************
+
+Re-entrant version of the conversion kernels of cesu8.c: the same find/check/convert steps, but
+working on caller supplied buffers instead of the global buff/obuff, and without reporting to
+stderr. See cesu8.c for the description of the byte sequences and cesu8.h for the API.
+The kernels and the buffer conversion are in cesu8-single.h, this file adds the streams.
+**************************************************************************************************/
+
+#define _GNU_SOURCE         // fopencookie()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "cesu8.h"
+
+#define CESU8_DEF                   // extern definitions of cesu8_convert() and cesu8_convert_cow()
+#define CESU8_IMPLEMENTATION
+#include "cesu8-single.h"           // the kernels and the buffer conversion
+
+#define U_BYTE              0xed    // 1110 1101: lead byte of the CESU-8 surrogates
+#define P_BYTE_FIXMASK      0xf8
+#define P_BYTE_FIXVAL       0xf0    // 1111 0VVV: lead byte of the 4-byte UTF-8 sequences
+
+#define BSIZE 4096
+#define LBSIZE (64 * 1024)          // initial buffer size of the line iterator (grown for longer lines)
+
+////////////////////////////////////////////
+// Converting input stream:
+
+struct stream {
+    FILE *fpi;                      // input FILE pointer
+    int flags;
+    bool eof;                       // fpi reached its end: a partial sequence at the end of buff is the last one
+
+    // input chunk, like buff/blen/rlen of the cesu8 tool:
+    unsigned char buff[BSIZE];
+    size_t blen;                    // total bytes loaded to buff
+    size_t rlen;                    // input bytes already processed in buff
+
+    // a converted sequence that didn't fit to the reader's buffer:
+    unsigned char pend[6];
+    size_t plen;                    // bytes converted to pend
+    size_t ppos;                    // bytes of pend already given to the reader
+};
+
+static int readFile(struct stream *st)                                      // read next chunk from fpi to buff
+{
+    // unprocessed bytes are to be moved to the start of buff:
+    if (st->blen > st->rlen)
+        memmove(st->buff, st->buff + st->rlen, st->blen - st->rlen);        // (areas could overlap!)
+    st->blen -= st->rlen;
+    st->rlen = 0;
+
+    size_t bts = fread(st->buff + st->blen, 1, BSIZE - st->blen, st->fpi);
+    st->blen += bts;
+
+    if (ferror(st->fpi))
+        return -1;
+    if (bts == 0)
+        st->eof = true;
+    return 0;
+}
+
+static ssize_t readStream(void *cookie, char *buf, size_t size)
+{
+    struct stream *st = cookie;
+    size_t n = 0;
+
+    while (n < size) {
+        if (st->ppos < st->plen) {
+            size_t len = st->plen - st->ppos;
+            if (len > size - n)
+                len = size - n;
+            memcpy(buf + n, st->pend + st->ppos, len);
+            st->ppos += len;
+            n += len;
+            continue;
+        }
+        if (st->rlen == st->blen && st->eof)
+            break;      // no more bytes to process
+
+        // convert straight to the reader's buffer:
+        int flags = st->flags | (st->eof ? CESU8_LAST : 0);
+        size_t inlen = st->blen - st->rlen;
+        size_t outlen = size - n;
+        int status = cesu8_convert(flags, st->buff + st->rlen, &inlen, (unsigned char *)buf + n, &outlen);
+        st->rlen += inlen;
+        n += outlen;
+
+        if (status == CESU8_FULL && outlen == 0) {
+            // the next sequence is longer than the space left in buf: convert it to pend
+            st->plen = sizeof(st->pend);
+            st->ppos = 0;
+            inlen = st->blen - st->rlen;
+            cesu8_convert(flags, st->buff + st->rlen, &inlen, st->pend, &st->plen);
+            st->rlen += inlen;
+        } else if (status != CESU8_FULL) {
+            // all of buff is converted (or a partial sequence is left at its end): load next chunk
+            if (readFile(st) != 0 && n == 0)
+                return -1;
+        }
+    }
+    return n;
+}
+
+static int closeStream(void *cookie)
+{
+    struct stream *st = cookie;
+    int cl = fclose(st->fpi);
+    free(st);
+    return cl;
+}
+
+FILE *cesu8_fopen(FILE *fp, int flags)
+{
+    struct stream *st = calloc(1, sizeof(*st));
+    if (!st)
+        return NULL;
+    st->fpi = fp;
+    st->flags = flags & ~CESU8_STRICT;      // there's no way to report invalid codes through the stream
+
+    cookie_io_functions_t io = { readStream, NULL, NULL, closeStream };
+    FILE *fpc = fopencookie(st, "rb", io);
+    if (!fpc)
+        free(st);
+    return fpc;
+}
+
+FILE *cesu8_fdopen(int fd, int flags)
+{
+    FILE *fp = fdopen(fd, "rb");
+    if (!fp)
+        return NULL;
+    FILE *fpc = cesu8_fopen(fp, flags);
+    if (!fpc)
+        fclose(fp);
+    return fpc;
+}
+
+////////////////////////////////////////////
+// Line iterator:
+
+struct cesu8_lines {
+    FILE *fpi;                      // input FILE pointer
+    int flags;
+    bool eof;
+
+    // input, the lines are returned from here if possible:
+    unsigned char *buff;
+    size_t bsize;                   // allocated size of buff
+    size_t blen;                    // total bytes loaded to buff
+    size_t rlen;                    // bytes of buff already returned
+    size_t scanned;                 // bytes after rlen already scanned (no newline there)
+    bool dirty;                     // a lead byte found in the scanned bytes: the line is to be converted
+
+    // lines converted to CESU-8 (they may be longer than the input):
+    unsigned char *out;
+    size_t osize;
+};
+
+#define LOW_BITS            0x0101010101010101ull
+#define HIGH_BITS           0x8080808080808080ull
+#define HAS_ZERO(x)         (((x) - LOW_BITS) & ~(x) & HIGH_BITS)       // flags a zero byte (and maybe the ones after it)
+
+// Find the newline in buff[i..blen) and check for lead bytes of the sequences to convert at the same
+// time (8 bytes at once); returns the position of the newline (or blen), *dirty set if a lead is found.
+static size_t scan_line(const unsigned char *buff, size_t i, size_t blen, int flags, bool *dirty)
+{
+    const uint64_t NLS = LOW_BITS * '\n';
+    const uint64_t US = LOW_BITS * U_BYTE;
+    bool u2c = flags & CESU8_U2C;
+
+    while (i < blen && !*dirty) {
+        if (i + 8 <= blen) {
+            uint64_t x;
+            memcpy(&x, buff + i, 8);
+            uint64_t lead = u2c ? (x & (x << 1) & (x << 2) & (x << 3) & HIGH_BITS) : HAS_ZERO(x ^ US);
+            if (!(HAS_ZERO(x ^ NLS) | lead)) {
+                i += 8;
+                continue;
+            }
+        }
+        for (size_t e = (i + 8 < blen) ? i + 8 : blen; i < e; i++) {
+            if (buff[i] == '\n')
+                return i;
+            if (u2c ? (buff[i] & P_BYTE_FIXMASK) == P_BYTE_FIXVAL : buff[i] == U_BYTE) {
+                *dirty = true;
+                break;
+            }
+        }
+    }
+    // the line is to be converted anyway: just find its end
+    const unsigned char *nl = (i < blen) ? memchr(buff + i, '\n', blen - i) : NULL;
+    return nl ? (size_t)(nl - buff) : blen;
+}
+
+static int fillLines(struct cesu8_lines *ln)                                // read more input after the current line
+{
+    if (ln->rlen > 0) {
+        // the line spans the end of buff: move it to the start
+        memmove(ln->buff, ln->buff + ln->rlen, ln->blen - ln->rlen);
+        ln->blen -= ln->rlen;
+        ln->rlen = 0;
+    } else if (ln->blen == ln->bsize) {
+        // the line is longer than buff
+        unsigned char *nb = realloc(ln->buff, ln->bsize * 2);
+        if (!nb)
+            return -1;
+        ln->buff = nb;
+        ln->bsize *= 2;
+    }
+    size_t bts = fread(ln->buff + ln->blen, 1, ln->bsize - ln->blen, ln->fpi);
+    ln->blen += bts;
+    if (ferror(ln->fpi))
+        return -1;
+    if (bts == 0)
+        ln->eof = true;
+    return 0;
+}
+
+struct cesu8_lines *cesu8_lines_open(FILE *fp, int flags)
+{
+    struct cesu8_lines *ln = calloc(1, sizeof(*ln));
+    if (!ln || !(ln->buff = malloc(LBSIZE))) {
+        free(ln);
+        return NULL;
+    }
+    ln->fpi = fp;
+    ln->flags = flags;
+    ln->bsize = LBSIZE;
+    return ln;
+}
+
+int cesu8_lines_next(struct cesu8_lines *ln, const unsigned char **line, size_t *len)
+{
+    size_t end;
+    for (;;) {
+        end = scan_line(ln->buff, ln->rlen + ln->scanned, ln->blen, ln->flags, &ln->dirty);
+        if (end < ln->blen) {
+            end++;      // (the newline belongs to the line)
+            break;
+        }
+        ln->scanned = end - ln->rlen;
+        if (ln->eof) {
+            if (ln->rlen == ln->blen)
+                return 0;       // no more lines
+            break;              // last line, without newline
+        }
+        if (fillLines(ln) != 0)
+            return -1;
+    }
+
+    unsigned char *s = ln->buff + ln->rlen;
+    size_t inlen = end - ln->rlen;
+    bool dirty = ln->dirty;
+    ln->rlen = end;
+    ln->scanned = 0;
+    ln->dirty = false;
+
+    if (!dirty) {
+        // nothing to convert: the line is returned where it is
+        *line = s;
+        *len = inlen;
+        return 1;
+    }
+
+    unsigned char *d = s;           // CESU-8 to UTF-8: converted in place (output is never longer)
+    size_t outlen = inlen;
+    if (ln->flags & CESU8_U2C) {
+        outlen = inlen + inlen / 2;
+        if (outlen > ln->osize) {
+            unsigned char *nb = realloc(ln->out, outlen);
+            if (!nb)
+                return -1;
+            ln->out = nb;
+            ln->osize = outlen;
+        }
+        d = ln->out;
+    }
+    // a line never ends inside a sequence:
+    if (cesu8_convert(ln->flags | CESU8_LAST, s, &inlen, d, &outlen) == CESU8_INVALID) {
+        errno = EILSEQ;
+        return -1;
+    }
+    *line = d;
+    *len = outlen;
+    return 1;
+}
+
+int cesu8_lines_close(struct cesu8_lines *ln)
+{
+    int cl = fclose(ln->fpi);
+    free(ln->buff);
+    free(ln->out);
+    free(ln);
+    return cl;
+}
+
+// vim: tabstop=4 shiftwidth=4 softtabstop=4 expandtab: